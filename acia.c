@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "acia.h"
@@ -37,77 +38,102 @@
 #define RXDATA				3
 
 
-static unsigned int baseaddr;
-static uint8_t regs[4];
+struct ACIA_CTX {
+	M68_CTX *ctx;
+	unsigned int baseaddr;
+	uint8_t regs[4];
 
-static void (*on_write)(uint8_t data);
+	void (*on_write)(void *user, uint8_t data);
+	void *user;
+};
 
 
-static void dump()
+static void dump(ACIA_CTX *acia)
 {
-	printf("CTRL %02x, TXDATA %02x, STATUS %02x, RXDATA %02x\n", regs[CTRL], regs[TXDATA], regs[STATUS], regs[RXDATA]);
+	printf("CTRL %02x, TXDATA %02x, STATUS %02x, RXDATA %02x\n", acia->regs[CTRL], acia->regs[TXDATA], acia->regs[STATUS], acia->regs[RXDATA]);
 }
 
-void
-acia_attach(uint16_t addr, void (*on_tx)(uint8_t))
+ACIA_CTX *
+acia_new(void)
 {
-	baseaddr = addr;
-	on_write = on_tx;
-
-	regs[STATUS] = TXEMPTY & ~RXAVAIL;
+	return calloc(1, sizeof(ACIA_CTX));
 }
 
-int 
-acia_active(uint16_t addr)
+void
+acia_destroy(ACIA_CTX *acia)
 {
-	return (addr >= baseaddr && addr<baseaddr+2);
+	free(acia);
 }
 
-uint8_t
-acia_read(uint16_t addr)
+static uint8_t
+acia_read(void *dev, const uint16_t addr)
 {
-	int idx = 0x2 | (addr - baseaddr);
-	uint8_t ch = regs[idx];
+	ACIA_CTX *acia = dev;
+	int idx = 0x2 | (addr - acia->baseaddr);
+	uint8_t ch = acia->regs[idx];
 
-	if (idx == RXDATA) 
-		regs[STATUS] &= ~RXAVAIL;
+	if (idx == RXDATA) {
+		acia->regs[STATUS] &= ~RXAVAIL;
+		m68_irq_clear(acia->ctx, M68_VEC_IRQ);
+	}
 
 //	printf("ACIA: reading reg %d: 0x%02x\n", idx, ch);
-//	dump();
+//	dump(acia);
 
 	return ch;
 }
 
-void
-acia_write(uint16_t addr, uint8_t data)
+static void
+acia_write(void *dev, const uint16_t addr, const uint8_t data)
 {
-	int idx = addr - baseaddr;
+	ACIA_CTX *acia = dev;
+	int idx = addr - acia->baseaddr;
 
-//	printf("ACIA: writing reg %d: 0x%02x -> 0x%02x\n", idx, regs[idx], data);
+//	printf("ACIA: writing reg %d: 0x%02x -> 0x%02x\n", idx, acia->regs[idx], data);
 
-	regs[idx] = data;
+	acia->regs[idx] = data;
 	if (idx == TXDATA) {
-		regs[STATUS] &= ~TXEMPTY;
-		if (on_write)
-			on_write(data);
-		regs[STATUS] |= TXEMPTY;
+		acia->regs[STATUS] &= ~TXEMPTY;
+		if (acia->on_write)
+			acia->on_write(acia->user, data);
+		acia->regs[STATUS] |= TXEMPTY;
 	}
-	if ((regs[CTRL] & 3) == BAUD_RESET) {
-		regs[STATUS] = TXEMPTY & ~RXAVAIL;
-		regs[CTRL] &= ~3;
+	if ((acia->regs[CTRL] & 3) == BAUD_RESET) {
+		acia->regs[STATUS] = TXEMPTY & ~RXAVAIL;
+		acia->regs[CTRL] &= ~3;
 	}
+	if ((acia->regs[CTRL] & RXIE) == 0 || (acia->regs[STATUS] & RXAVAIL) == 0)
+		m68_irq_clear(acia->ctx, M68_VEC_IRQ);
+
+//	dump(acia);
+}
+
+/*
+ * Attach the ACIA to 'ctx' with its two registers at 'addr'.
+ *
+ * @return	0, or -1 if the registers cannot be registered
+ */
+int
+acia_attach(ACIA_CTX *acia, M68_CTX *ctx, uint16_t addr, void (*on_tx)(void *, uint8_t), void *user)
+{
+	acia->ctx = ctx;
+	acia->baseaddr = addr;
+	acia->on_write = on_tx;
+	acia->user = user;
 
-//	dump();
+	acia->regs[STATUS] = TXEMPTY & ~RXAVAIL;
+	return m68_io_register(ctx, addr, 2, acia_read, acia_write, acia);
 }
 
 void
-acia_rx(uint8_t data)
+acia_rx(ACIA_CTX *acia, uint8_t data)
 {
-	regs[RXDATA] = data;
-	regs[STATUS] |= RXAVAIL;
-	if ((regs[CTRL] & RXIE) == RXIE)
-		printf("do ACIA interrupt\n");
+	acia->regs[RXDATA] = data;
+	acia->regs[STATUS] |= RXAVAIL;
+	/* the ACIA sits on the external IRQ line */
+	if ((acia->regs[CTRL] & RXIE) == RXIE)
+		m68_irq(acia->ctx, M68_VEC_IRQ);
 
 //	printf("character from keyboard\n");
-//	dump();
+//	dump(acia);
 }
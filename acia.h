@@ -1,8 +1,11 @@
 #include <stdint.h>
 
-int acia_active(uint16_t addr);
-void acia_attach(uint16_t addr, void (*on_tx)(uint8_t));
-uint8_t acia_read(uint16_t addr);
-void acia_write(uint16_t addr, uint8_t data);
+#include "m68emu.h"
 
-void acia_rx(uint8_t ch);
+typedef struct ACIA_CTX ACIA_CTX;
+
+ACIA_CTX *acia_new(void);
+void acia_destroy(ACIA_CTX *acia);
+int acia_attach(ACIA_CTX *acia, M68_CTX *ctx, uint16_t addr, void (*on_tx)(void *user, uint8_t), void *user);
+
+void acia_rx(ACIA_CTX *acia, uint8_t ch);
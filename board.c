@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>	/* mmap() */
+#include <unistd.h>	/* sysconf() */
+
+#include "board.h"
+
+
+/*
+ * Memory address behind CPU address 'addr', through the memory map.
+ */
+static inline uint16_t
+phys_addr(BOARD *board, const uint16_t addr)
+{
+	return (board->map[addr >> M68_PAGE_SHIFT].phys << M68_PAGE_SHIFT) | (addr & (M68_PAGE_SIZE - 1));
+}
+
+static inline uint8_t *
+mem_byte(BOARD *board, const uint16_t phys)
+{
+	return &board->page[phys >> M68_PAGE_SHIFT][phys & (M68_PAGE_SIZE - 1)];
+}
+
+/*
+ * Give the board its own copy of a shared ROM page. Wherever the page was
+ * mapped into the CPU, the copy is mapped in its place, writable.
+ */
+static void
+copy_page(BOARD *board, unsigned int phys)
+{
+	uint8_t *copy = malloc(M68_PAGE_SIZE);
+	unsigned int page;
+
+	if (copy == NULL)
+		return;
+	memcpy(copy, board->page[phys], M68_PAGE_SIZE);
+	board->own[phys] = board->page[phys] = copy;
+	for (page = 0; page < M68_PAGE_COUNT; page++) {
+		if (board->map[page].phys == phys && board->ctx.mem_rd[page] != NULL)
+			m68_map_pages(&board->ctx, page << M68_PAGE_SHIFT, M68_PAGE_SIZE, copy, M68_MAP_READ | M68_MAP_WRITE);
+	}
+}
+
+/*
+ * Store a byte at CPU address 'addr', applying the ROM write policy to
+ * shared pages.
+ */
+static inline void
+store(BOARD *board, const uint16_t addr, const uint8_t data)
+{
+	const uint16_t phys = phys_addr(board, addr);
+	const unsigned int page = phys >> M68_PAGE_SHIFT;
+
+	if (board->own[page] == NULL) {
+		switch (board->rom_policy) {
+			case BOARD_ROM_COPY:
+				copy_page(board, page);
+				if (board->own[page] == NULL)
+					return;
+				break;
+			case BOARD_ROM_TRAP:
+				board->rom_trapped = true;
+				board->rom_trap_addr = addr;
+				board->ctx.stop_request = true;
+				return;
+			case BOARD_ROM_IGNORE:
+			default:
+				return;
+		}
+	}
+	*mem_byte(board, phys) = data;
+}
+
+/*
+ * Port A, of which only the I/O pad is modelled: it always reads high,
+ * and with port_trace set, writes are logged as a waveform.
+ */
+static uint8_t
+pad_read(void *dev, const uint16_t addr)
+{
+	return 1;
+}
+
+static void
+pad_write(void *dev, const uint16_t addr, const uint8_t data)
+{
+	BOARD *board = dev;
+
+	if (board->port_trace) {
+		printf("#%llu\n", (unsigned long long)board->ctx.cycles);
+		printf("%d#", data & 1);
+	}
+}
+
+/*
+ * Reading the trace trap address turns on instruction tracing.
+ */
+static uint8_t
+trap_read(void *dev, const uint16_t addr)
+{
+	BOARD *board = dev;
+
+	board->ctx.trace = true;
+	return *mem_byte(board, addr);
+}
+
+/*
+ * Memory callbacks. 'verbose' is a constant in each instantiation, so the
+ * callbacks installed for normal runs carry no logging code.
+ */
+static inline uint8_t
+board_read(struct M68_CTX *ctx, const uint16_t addr, const bool verbose)
+{
+	BOARD *board = ctx->user;
+	const uint16_t phys = phys_addr(board, addr);
+	const M68_IO *io;
+
+	if (board->map[addr >> M68_PAGE_SHIFT].type == MEMMAP_UNMAPPED) {
+		if (verbose && ctx->trace) {
+			printf("	MEM RD %04X = FF (unmapped)\n", addr);
+		}
+		return 0xff;
+	}
+	if (verbose && ctx->trace) {
+		printf("	MEM RD %04X = %02X\n", addr, *mem_byte(board, phys));
+	}
+
+	io = m68_io_find(ctx, phys);
+	if (io != NULL && io->read != NULL) {
+		return io->read(io->dev, phys);
+	}
+	return *mem_byte(board, phys);
+}
+
+static inline void
+board_write(struct M68_CTX *ctx, const uint16_t addr, const uint8_t data, const bool verbose)
+{
+	BOARD *board = ctx->user;
+	const uint16_t phys = phys_addr(board, addr);
+	const M68_IO *io;
+
+	if (verbose && ctx->trace) {
+		printf("	MEM WR %04X = %02X\n", addr, data);
+	}
+	if (board->map[addr >> M68_PAGE_SHIFT].type == MEMMAP_UNMAPPED) {
+		return;
+	}
+	store(board, addr, data);
+
+	io = m68_io_find(ctx, phys);
+	if (io != NULL && io->write != NULL) {
+		io->write(io->dev, phys, data);
+	}
+}
+
+static uint8_t
+readfunc(struct M68_CTX *ctx, const uint16_t addr)
+{
+	return board_read(ctx, addr, false);
+}
+
+static void
+writefunc(struct M68_CTX *ctx, const uint16_t addr, const uint8_t data)
+{
+	board_write(ctx, addr, data, false);
+}
+
+static uint8_t
+readfunc_verbose(struct M68_CTX *ctx, const uint16_t addr)
+{
+	return board_read(ctx, addr, true);
+}
+
+static void
+writefunc_verbose(struct M68_CTX *ctx, const uint16_t addr, const uint8_t data)
+{
+	board_write(ctx, addr, data, true);
+}
+
+/*
+ * ROM contents are allocated in whole host pages, so that board images
+ * can map their ROM straight over them.
+ */
+static size_t
+mem_length(unsigned int size)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) / page * page;
+}
+
+static unsigned int
+page_count(unsigned int size)
+{
+	return (size + M68_PAGE_SIZE - 1) >> M68_PAGE_SHIFT;
+}
+
+/**
+ * Create empty firmware for boards with 'size' bytes of memory: all zero,
+ * with no ROM pages. The caller holds the only reference.
+ *
+ * @return	The firmware, or NULL if out of memory
+ */
+BOARD_ROM *
+board_rom_new(unsigned int size)
+{
+	BOARD_ROM *rom;
+	void *mem;
+
+	if (size == 0 || size > 0x10000)
+		return NULL;
+	rom = calloc(1, sizeof(BOARD_ROM));
+	if (rom == NULL)
+		return NULL;
+	mem = mmap(NULL, mem_length(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		free(rom);
+		return NULL;
+	}
+	atomic_init(&rom->refs, 1);
+	rom->size = size;
+	rom->data = mem;
+	return rom;
+}
+
+/**
+ * Load an image file into firmware: S-records, Intel HEX or, failing
+ * those, raw binary at 'offset'. The pages it loads become ROM.
+ *
+ * @param	ld	Returns the extent of the image, or why it failed to load;
+ *				may be NULL
+ * @return	0 on success, -1 on error
+ */
+int
+board_rom_load(BOARD_ROM *rom, const char *filename, uint32_t offset, LOADER *ld)
+{
+	LOADER local;
+
+	if (ld == NULL)
+		ld = &local;
+	loader_init(ld, rom->data, rom->size);
+	ld->offset = offset;
+	if (loader_load_file(ld, filename, LOADER_AUTO) < 0)
+		return -1;
+	if (ld->bytes)
+		board_rom_protect(rom, ld->low, ld->high - ld->low);
+	return 0;
+}
+
+/**
+ * Mark the pages covering 'size' bytes at 'addr' as ROM.
+ */
+void
+board_rom_protect(BOARD_ROM *rom, uint32_t addr, uint32_t size)
+{
+	uint32_t page;
+
+	if (size == 0)
+		return;
+	for (page = addr >> M68_PAGE_SHIFT; page <= (addr + size - 1) >> M68_PAGE_SHIFT; page++)
+		if (page < page_count(rom->size))
+			rom->rom[page] = true;
+}
+
+/**
+ * Take a reference to firmware.
+ */
+BOARD_ROM *
+board_rom_ref(BOARD_ROM *rom)
+{
+	atomic_fetch_add(&rom->refs, 1);
+	return rom;
+}
+
+/**
+ * Drop a reference to firmware, freeing it with the last one.
+ */
+void
+board_rom_unref(BOARD_ROM *rom)
+{
+	if (rom == NULL || atomic_fetch_sub(&rom->refs, 1) != 1)
+		return;
+	munmap(rom->data, mem_length(rom->size));
+	free(rom);
+}
+
+/**
+ * @return	Name of a ROM write policy, as given on command lines
+ */
+const char *
+board_rom_policy_name(BOARD_ROM_POLICY policy)
+{
+	static const char *names[BOARD_ROM_POLICY_MAX] = { "copy", "ignore", "trap" };
+
+	return (policy < BOARD_ROM_POLICY_MAX) ? names[policy] : NULL;
+}
+
+/**
+ * Fill in the standard board layout with 'memsize' bytes of memory.
+ */
+void
+board_default_config(BOARD_CONFIG *config, unsigned int memsize)
+{
+	config->memsize = memsize;
+	config->uart_base = BOARD_UART_BASE;
+	config->acia_base = BOARD_ACIA_BASE;
+	config->timer_base = BOARD_TIMER_BASE;
+	config->map = NULL;
+}
+
+/**
+ * Create a board with 'memsize' bytes of zeroed, private memory and the
+ * standard set of peripherals. Bytes sent by the UART and ACIA are passed
+ * to 'on_tx'.
+ *
+ * @return	The new board, or NULL if out of memory
+ */
+BOARD *
+board_new(unsigned int memsize, void (*on_tx)(void *, uint8_t), void *user)
+{
+	BOARD_CONFIG config;
+
+	board_default_config(&config, memsize);
+	return board_new_config(&config, NULL, on_tx, user);
+}
+
+/*
+ * Does CPU page 'page' hold anything that needs the read/write callbacks
+ * (I/O registers or trap addresses)?
+ */
+static int
+page_has_io(BOARD *board, unsigned int page)
+{
+	return board->map[page].type == MEMMAP_IO || board->ctx.io_map[board->map[page].phys] != NULL;
+}
+
+/*
+ * The map used without a memory map: memory repeats through the address
+ * space, with the pages the firmware was loaded into as ROM.
+ */
+static void
+default_map(BOARD *board)
+{
+	const unsigned int pages = page_count(board->memsize);
+	unsigned int page;
+
+	for (page = 0; page < M68_PAGE_COUNT; page++) {
+		board->map[page].phys = page % pages;
+		board->map[page].type = board->rom->rom[page % pages] ? MEMMAP_ROM : MEMMAP_RAM;
+	}
+}
+
+/**
+ * Create a board laid out as 'config', running firmware 'rom', which
+ * must describe config->memsize bytes. The board takes its own reference
+ * to the firmware. With a NULL 'rom', memory starts zeroed and private.
+ *
+ * With a memory map, the map decides which pages are ROM; without one,
+ * the pages the firmware was loaded into are.
+ *
+ * The CPU is initialised but not reset; call board_map_memory() and
+ * m68_reset() before running it.
+ *
+ * @return	The new board, or NULL if out of memory, 'rom' does not fit,
+ *			the memory map does not compile (see memmap_compile()) or two
+ *			peripherals claim the same register
+ */
+BOARD *
+board_new_config(const BOARD_CONFIG *config, BOARD_ROM *rom, void (*on_tx)(void *, uint8_t), void *user)
+{
+	BOARD *board;
+	const char *error;
+	unsigned int page;
+
+	if (rom != NULL && rom->size != config->memsize)
+		return NULL;
+
+	board = calloc(1, sizeof(BOARD));
+	if (board == NULL)
+		return NULL;
+
+	board->config = *config;
+	board->memsize = config->memsize;
+	board->rom = rom ? board_rom_ref(rom) : board_rom_new(config->memsize);
+	board->uart = uart_new();
+	board->acia = acia_new();
+	board->timer = timer_new();
+	if (board->rom == NULL || board->uart == NULL ||
+	    board->acia == NULL || board->timer == NULL) {
+		board_destroy(board);
+		return NULL;
+	}
+
+	if (config->map == NULL) {
+		default_map(board);
+	} else if (memmap_compile(config->map, board->memsize, board->map, &error) < 0) {
+		board_destroy(board);
+		return NULL;
+	}
+
+	// m68_init() reads the reset vector, so memory has to be in place
+	for (page = 0; page < page_count(board->memsize); page++)
+		board->page[page] = board->rom->data + (page << M68_PAGE_SHIFT);
+
+	board->ctx.read_mem = &readfunc;
+	board->ctx.write_mem = &writefunc;
+	board->ctx.opdecode = NULL;
+	board->ctx.user = board;
+	m68_init(&board->ctx, M68_CPU_HC05C4);
+
+	if (uart_attach(board->uart, &board->ctx, config->uart_base, on_tx, user) < 0 ||
+	    acia_attach(board->acia, &board->ctx, config->acia_base, on_tx, user) < 0 ||
+	    timer_attach(board->timer, &board->ctx, config->timer_base) < 0 ||
+	    m68_io_register(&board->ctx, 0x0000, 1, pad_read, pad_write, board) < 0 ||
+	    m68_io_register(&board->ctx, 0x15c7, 1, trap_read, NULL, board) < 0) {
+		board_destroy(board);
+		return NULL;
+	}
+
+	// Share the ROM pages; copy the rest of the mapped memory, and any
+	// page with I/O on it
+	for (page = 0; page < M68_PAGE_COUNT; page++) {
+		const unsigned int phys = board->map[page].phys;
+
+		if (board->map[page].type == MEMMAP_UNMAPPED || board->own[phys] != NULL)
+			continue;
+		if (board->map[page].type == MEMMAP_ROM && !page_has_io(board, page))
+			continue;
+		board->own[phys] = malloc(M68_PAGE_SIZE);
+		if (board->own[phys] == NULL) {
+			board_destroy(board);
+			return NULL;
+		}
+		memcpy(board->own[phys], board->page[phys], M68_PAGE_SIZE);
+		board->page[phys] = board->own[phys];
+	}
+
+	return board;
+}
+
+/**
+ * Release a board and everything attached to it.
+ */
+void
+board_destroy(BOARD *board)
+{
+	unsigned int page;
+
+	if (board == NULL)
+		return;
+
+	m68_free(&board->ctx);
+	if (board->timer)
+		timer_destroy(board->timer);
+	if (board->acia)
+		acia_destroy(board->acia);
+	if (board->uart)
+		uart_destroy(board->uart);
+	for (page = 0; page < M68_PAGE_COUNT; page++)
+		free(board->own[page]);
+	board_rom_unref(board->rom);
+	free(board);
+}
+
+/**
+ * Map every CPU page of memory without I/O into the CPU page table,
+ * mirrors included. Private pages are mapped for reading and writing;
+ * shared ROM pages only for reading, so that writes to them reach the
+ * write policy. Pages showing the same memory are declared as aliases.
+ *
+ * With board->verbose set nothing is mapped and the logging memory
+ * callbacks are installed instead, so traced runs see every access.
+ */
+void
+board_map_memory(BOARD *board)
+{
+	unsigned int page, other;
+
+	// Tell the core which pages show the same memory, so that code
+	// cached at one is dropped when it is written through another
+	for (page = 0; page < M68_PAGE_COUNT; page++) {
+		if (board->map[page].type == MEMMAP_UNMAPPED)
+			continue;
+		for (other = 0; other < page; other++) {
+			if (board->map[other].type != MEMMAP_UNMAPPED && board->map[other].phys == board->map[page].phys) {
+				m68_alias_pages(&board->ctx, page << M68_PAGE_SHIFT, M68_PAGE_SIZE, other << M68_PAGE_SHIFT);
+				break;
+			}
+		}
+	}
+
+	if (board->verbose) {
+		board->ctx.read_mem = &readfunc_verbose;
+		board->ctx.write_mem = &writefunc_verbose;
+		return;
+	}
+
+	for (page = 0; page < M68_PAGE_COUNT; page++) {
+		const unsigned int phys = board->map[page].phys;
+
+		if (board->map[page].type == MEMMAP_UNMAPPED || page_has_io(board, page))
+			continue;
+		m68_map_pages(&board->ctx, page << M68_PAGE_SHIFT, M68_PAGE_SIZE, board->page[phys],
+			board->own[phys] ? M68_MAP_READ | M68_MAP_WRITE : M68_MAP_READ);
+	}
+}
+
+/**
+ * Read board memory at a CPU address without side effects.
+ */
+uint8_t
+board_peek(BOARD *board, uint16_t addr)
+{
+	if (board->map[addr >> M68_PAGE_SHIFT].type == MEMMAP_UNMAPPED)
+		return 0xff;
+	return *mem_byte(board, phys_addr(board, addr));
+}
+
+/**
+ * @return	Bytes of memory private to this board
+ */
+size_t
+board_footprint(BOARD *board)
+{
+	unsigned int page;
+	size_t bytes = 0;
+
+	for (page = 0; page < M68_PAGE_COUNT; page++)
+		if (board->own[page])
+			bytes += M68_PAGE_SIZE;
+	return bytes;
+}
+
+/**
+ * Write the CPU profile to <prefix>.callgrind and <prefix>.folded.
+ *
+ * @return	0 on success, -1 if the profiler is off or a file cannot be written
+ */
+int
+board_write_profile(BOARD *board, const char *prefix, const char *cmd)
+{
+	char filename[1024];
+	FILE *f;
+	int rc;
+
+	snprintf(filename, sizeof(filename), "%s.callgrind", prefix);
+	f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	rc = m68_profile_callgrind(&board->ctx, f, cmd);
+	if (fclose(f) != 0 || rc < 0)
+		return -1;
+
+	snprintf(filename, sizeof(filename), "%s.folded", prefix);
+	f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	rc = m68_profile_folded(&board->ctx, f);
+	if (fclose(f) != 0 || rc < 0)
+		return -1;
+	return 0;
+}
+
+/* differing memory bytes listed individually by board_compare() */
+#define MAX_MEM_DIFFS	8
+
+/**
+ * Compare the CPU state and memory of two boards, as a lockstep run does
+ * at each sync point. Memory is compared byte for byte, so writes through
+ * mapped pages, which never reach the write callback, are covered too.
+ *
+ * @return	0 if they match, otherwise 1 with a report of the state of
+ *			both boards in 'buf', differences marked with '*'
+ */
+int
+board_compare(BOARD *a, BOARD *b, char *buf, size_t size)
+{
+	M68_CTX *x = &a->ctx, *y = &b->ctx;
+	const uint8_t ccr_a = m68_get_ccr(x), ccr_b = m68_get_ccr(y);
+	const unsigned int memsize = a->memsize < b->memsize ? a->memsize : b->memsize;
+	unsigned int addr, page, diffs = 0;
+	bool mem_differs = false;
+	size_t n = 0;
+	int differ;
+
+	// Pages still shared between the two boards are the same by definition
+	for (page = 0; page < page_count(memsize) && !mem_differs; page++) {
+		const unsigned int len = memsize - (page << M68_PAGE_SHIFT) < M68_PAGE_SIZE ?
+			memsize - (page << M68_PAGE_SHIFT) : M68_PAGE_SIZE;
+
+		mem_differs = a->page[page] != b->page[page] && memcmp(a->page[page], b->page[page], len) != 0;
+	}
+
+	differ = x->pc_next != y->pc_next || x->reg_acc != y->reg_acc ||
+		x->reg_x != y->reg_x || x->reg_sp != y->reg_sp || ccr_a != ccr_b ||
+		x->cycles != y->cycles || x->irq_pending != y->irq_pending ||
+		x->is_waiting != y->is_waiting || x->is_stopped != y->is_stopped ||
+		a->memsize != b->memsize || mem_differs;
+	if (!differ)
+		return 0;
+
+#define REPORT(...) \
+	do { if (n < size) n += snprintf(buf + n, size - n, __VA_ARGS__); } while (0)
+#define FIELD(name, fmt, va, vb) \
+	REPORT("\t%-8s " fmt "  " fmt "%s\n", name, va, vb, (va) != (vb) ? "  *" : "")
+
+	REPORT("\t%-8s %8s  %8s\n", "", m68_engine_name(x->engine), m68_engine_name(y->engine));
+	FIELD("PC", "%8.4X", x->pc_next, y->pc_next);
+	FIELD("A", "%8.2X", x->reg_acc, y->reg_acc);
+	FIELD("X", "%8.2X", x->reg_x, y->reg_x);
+	FIELD("SP", "%8.4X", x->reg_sp, y->reg_sp);
+	FIELD("CCR", "%8.2X", ccr_a, ccr_b);
+	FIELD("cycles", "%8llu", (unsigned long long)x->cycles, (unsigned long long)y->cycles);
+	FIELD("irq", "%8.4X", x->irq_pending, y->irq_pending);
+	FIELD("wait", "%8d", x->is_waiting, y->is_waiting);
+	FIELD("stop", "%8d", x->is_stopped, y->is_stopped);
+
+	for (addr = 0; mem_differs && addr < memsize; addr++) {
+		const uint8_t va = board_peek(a, addr), vb = board_peek(b, addr);
+
+		if (va == vb)
+			continue;
+		if (diffs++ < MAX_MEM_DIFFS)
+			REPORT("\tmem %04X       %02X        %02X  *\n", addr, va, vb);
+	}
+	if (diffs > MAX_MEM_DIFFS)
+		REPORT("\t... %u more bytes differ\n", diffs - MAX_MEM_DIFFS);
+
+#undef FIELD
+#undef REPORT
+	return 1;
+}
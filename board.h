@@ -0,0 +1,105 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "m68emu.h"
+#include "loader.h"
+#include "memmap.h"
+#include "uart.h"
+#include "acia.h"
+#include "timer.h"
+
+/* Standard peripheral addresses */
+#define BOARD_UART_BASE		0x0d
+#define BOARD_ACIA_BASE		0x17f8
+#define BOARD_TIMER_BASE	0x08
+
+/**
+ * Board layout: memory size and where each peripheral sits
+ */
+typedef struct BOARD_CONFIG {
+	unsigned int	memsize;				///< Bytes of memory, at most 0x10000
+	uint16_t		uart_base;				///< First SCI register
+	uint16_t		acia_base;				///< First ACIA register
+	uint16_t		timer_base;				///< First timer register
+	const MEMMAP *	map;					///< Memory map, or NULL for memory repeating every memsize bytes (rounded up to a page)
+} BOARD_CONFIG;
+
+/**
+ * Firmware shared by every board that runs it.
+ *
+ * Holds the initial contents of memory. Pages marked as ROM are read in
+ * place by all the boards using it; every other page is copied into each
+ * board when it is created. Fill it in before creating any boards from
+ * it; after that it is immutable and may be used from any thread.
+ */
+typedef struct BOARD_ROM {
+	atomic_int		refs;					///< References, see board_rom_unref()
+	unsigned int	size;					///< Bytes of memory described
+	uint8_t *		data;					///< Initial contents, page aligned
+	bool			rom[M68_PAGE_COUNT];	///< Shared read-only pages
+} BOARD_ROM;
+
+/**
+ * What a write to a shared ROM page does
+ */
+typedef enum {
+	BOARD_ROM_COPY,			///< Give the board a private copy of the page, then write it
+	BOARD_ROM_IGNORE,		///< Drop the write, as real ROM would
+	BOARD_ROM_TRAP,			///< Drop the write and stop m68_run(), see BOARD::rom_trapped
+	BOARD_ROM_POLICY_MAX
+} BOARD_ROM_POLICY;
+
+/**
+ * An emulated board: CPU, memory and peripherals.
+ *
+ * Memory is a table of 256-byte pages. ROM pages point into the shared
+ * BOARD_ROM; the rest, including every page with I/O on it, are private
+ * to the board, so a board costs only its RAM and I/O pages. Boards share
+ * nothing writable, so any number of them can run side by side on
+ * separate threads.
+ *
+ * Every CPU access goes through the compiled memory map, which gives the
+ * page of memory behind each CPU page, so mirrors and unmapped space cost
+ * one table lookup rather than range checks.
+ */
+typedef struct BOARD {
+	M68_CTX			ctx;					///< CPU context; ctx.user points back at the board
+	BOARD_ROM *		rom;					///< Initial contents and shared pages
+	MEMMAP_PAGE		map[M68_PAGE_COUNT];	///< Compiled memory map: what is behind each CPU page
+	uint8_t *		page[M68_PAGE_COUNT];	///< Host memory behind each page of memsize
+	uint8_t *		own[M68_PAGE_COUNT];	///< The board's private copy of each page, or NULL while shared
+	unsigned int	memsize;				///< Bytes of memory; the map decides where it appears
+	BOARD_CONFIG	config;					///< Layout the board was built with
+	UART_CTX *		uart;					///< SCI at config.uart_base
+	ACIA_CTX *		acia;					///< ACIA at config.acia_base
+	TIMER_CTX *		timer;					///< Timer at config.timer_base
+	BOARD_ROM_POLICY rom_policy;			///< What writes to ROM do
+	bool			rom_trapped;			///< A write to ROM stopped the run (BOARD_ROM_TRAP)
+	uint16_t		rom_trap_addr;			///< Address of that write
+	int				verbose;				///< Verbosity for memory tracing, set before board_map_memory()
+	bool			port_trace;				///< Log writes to port A
+} BOARD;
+
+BOARD_ROM *board_rom_new(unsigned int size);
+int board_rom_load(BOARD_ROM *rom, const char *filename, uint32_t offset, LOADER *ld);
+void board_rom_protect(BOARD_ROM *rom, uint32_t addr, uint32_t size);
+BOARD_ROM *board_rom_ref(BOARD_ROM *rom);
+void board_rom_unref(BOARD_ROM *rom);
+
+const char *board_rom_policy_name(BOARD_ROM_POLICY policy);
+void board_default_config(BOARD_CONFIG *config, unsigned int memsize);
+BOARD *board_new(unsigned int memsize, void (*on_tx)(void *user, uint8_t), void *user);
+BOARD *board_new_config(const BOARD_CONFIG *config, BOARD_ROM *rom, void (*on_tx)(void *user, uint8_t), void *user);
+void board_destroy(BOARD *board);
+void board_map_memory(BOARD *board);
+uint8_t board_peek(BOARD *board, uint16_t addr);
+size_t board_footprint(BOARD *board);
+int board_write_profile(BOARD *board, const char *prefix, const char *cmd);
+int board_compare(BOARD *a, BOARD *b, char *buf, size_t size);
+
+#endif
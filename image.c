@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>	/* open() */
+#include <sys/mman.h>	/* mmap() */
+#include <sys/stat.h>	/* fstat() */
+#include <unistd.h>	/* pread(), sysconf() */
+
+#include "image.h"
+
+#define HEADER_SIZE	16
+#define DEVICE_SIZE	4
+#define REGION_SIZE	16
+
+#define MAX_DEVICES	16
+#define MAX_REGIONS	256
+
+
+static uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static uint8_t *
+put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v);
+	return put16(p, v >> 16);
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint32_t
+align(uint32_t v)
+{
+	return (v + IMAGE_ALIGN - 1) & ~(uint32_t)(IMAGE_ALIGN - 1);
+}
+
+/**
+ * Write a board image holding 'regions' of 'mem', laid out as 'config'.
+ *
+ * @return	0 on success, -1 on error
+ */
+int
+image_write(const char *filename, const BOARD_CONFIG *config, const uint8_t *mem,
+	const IMAGE_REGION *regions, int nregions)
+{
+	static const uint8_t zeros[IMAGE_ALIGN];
+	const uint32_t tables = HEADER_SIZE + 3 * DEVICE_SIZE + nregions * REGION_SIZE;
+	uint8_t *header, *p;
+	uint32_t offset;
+	FILE *f;
+	int i, rc = 0;
+
+	if (nregions < 0 || nregions > MAX_REGIONS)
+		return -1;
+	for (i = 0; i < nregions; i++)
+		if (regions[i].addr > config->memsize || regions[i].size > config->memsize - regions[i].addr)
+			return -1;
+
+	header = calloc(1, tables);
+	if (header == NULL)
+		return -1;
+
+	p = header;
+	memcpy(p, IMAGE_MAGIC, 4);
+	p = put16(p + 4, IMAGE_VERSION);
+	p = put16(p, 3);
+	p = put32(p, config->memsize);
+	p = put16(p, nregions);
+	p = put16(p, 0);
+
+	p = put16(p, IMAGE_DEV_UART);
+	p = put16(p, config->uart_base);
+	p = put16(p, IMAGE_DEV_ACIA);
+	p = put16(p, config->acia_base);
+	p = put16(p, IMAGE_DEV_TIMER);
+	p = put16(p, config->timer_base);
+
+	offset = align(tables);
+	for (i = 0; i < nregions; i++) {
+		p = put32(p, regions[i].addr);
+		p = put32(p, regions[i].size);
+		p = put32(p, offset);
+		p = put32(p, regions[i].flags);
+		offset = align(offset + regions[i].size);
+	}
+
+	f = fopen(filename, "wb");
+	if (f == NULL) {
+		free(header);
+		return -1;
+	}
+	if (fwrite(header, 1, tables, f) != tables)
+		rc = -1;
+	offset = tables;
+	for (i = 0; i < nregions && rc == 0; i++) {
+		uint32_t pad = align(offset) - offset;
+
+		if (fwrite(zeros, 1, pad, f) != pad ||
+		    fwrite(mem + regions[i].addr, 1, regions[i].size, f) != regions[i].size)
+			rc = -1;
+		offset += pad + regions[i].size;
+	}
+	if (fclose(f) != 0)
+		rc = -1;
+	free(header);
+	return rc;
+}
+
+/**
+ * @return	True if 'filename' is a board image
+ */
+bool
+image_probe(const char *filename)
+{
+	char magic[4];
+	FILE *f;
+	bool rc;
+
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+	rc = fread(magic, 1, 4, f) == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+	fclose(f);
+	return rc;
+}
+
+/*
+ * Fill a region of firmware from the image: mapped from the file if it is
+ * ROM and page aligned, copied otherwise.
+ */
+static int
+load_region(BOARD_ROM *rom, int fd, uint32_t addr, uint32_t size, uint32_t offset, uint32_t flags)
+{
+	const uint32_t page = sysconf(_SC_PAGESIZE);
+
+	if (flags & IMAGE_REGION_ROM) {
+		board_rom_protect(rom, addr, size);
+		if (addr % page == 0 && size % page == 0 && offset % page == 0 &&
+		    mmap(rom->data + addr, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED)
+			return 0;
+	}
+	return pread(fd, rom->data + addr, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+/**
+ * Load the firmware and layout held in a board image. Boards are created
+ * from them with board_new_config().
+ *
+ * @param	config	Returns the board layout
+ * @param	error	Returns the reason for failure
+ * @return	The firmware, or NULL on failure
+ */
+BOARD_ROM *
+image_open(const char *filename, BOARD_CONFIG *config, const char **error)
+{
+	uint8_t header[HEADER_SIZE];
+	uint8_t *tables = NULL;
+	BOARD_ROM *rom = NULL;
+	struct stat st;
+	unsigned ndevices, nregions, i;
+	size_t len;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		*error = "cannot open file";
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE ||
+	    memcmp(header, IMAGE_MAGIC, 4) != 0) {
+		*error = "not a board image";
+		goto out;
+	}
+	if (get16(header + 4) != IMAGE_VERSION) {
+		*error = "unsupported board image version";
+		goto out;
+	}
+
+	ndevices = get16(header + 6);
+	nregions = get16(header + 12);
+	board_default_config(config, get32(header + 8));
+	if (ndevices > MAX_DEVICES || nregions > MAX_REGIONS || config->memsize == 0 || config->memsize > 0x10000) {
+		*error = "corrupt board image";
+		goto out;
+	}
+	len = ndevices * DEVICE_SIZE + nregions * REGION_SIZE;
+	tables = malloc(len ? len : 1);
+	if (tables == NULL || pread(fd, tables, len, HEADER_SIZE) != (ssize_t)len) {
+		*error = "corrupt board image";
+		goto out;
+	}
+
+	for (i = 0; i < ndevices; i++) {
+		const uint8_t *dev = tables + i * DEVICE_SIZE;
+
+		switch (get16(dev)) {
+			case IMAGE_DEV_UART:
+				config->uart_base = get16(dev + 2);
+				break;
+			case IMAGE_DEV_ACIA:
+				config->acia_base = get16(dev + 2);
+				break;
+			case IMAGE_DEV_TIMER:
+				config->timer_base = get16(dev + 2);
+				break;
+			default:
+				*error = "unknown device in board image";
+				goto out;
+		}
+	}
+
+	rom = board_rom_new(config->memsize);
+	if (rom == NULL) {
+		*error = "out of memory";
+		goto out;
+	}
+
+	for (i = 0; i < nregions; i++) {
+		const uint8_t *reg = tables + ndevices * DEVICE_SIZE + i * REGION_SIZE;
+		const uint32_t addr = get32(reg), size = get32(reg + 4), offset = get32(reg + 8);
+
+		if (addr > config->memsize || size > config->memsize - addr ||
+		    offset > st.st_size || size > st.st_size - offset ||
+		    load_region(rom, fd, addr, size, offset, get32(reg + 12)) < 0) {
+			*error = "corrupt board image";
+			board_rom_unref(rom);
+			rom = NULL;
+			goto out;
+		}
+	}
+
+out:
+	free(tables);
+	close(fd);
+	return rom;
+}
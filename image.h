@@ -0,0 +1,50 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "board.h"
+
+/*
+ * Board image: a prebuilt board, ready to run with no parsing.
+ *
+ * All fields are little-endian.
+ *
+ *	header		"M68B", u16 version, u16 device count, u32 memsize,
+ *				u16 region count, u16 reserved
+ *	devices		u16 type, u16 base address; one per peripheral
+ *	regions		u32 address, u32 size, u32 file offset, u32 flags
+ *	data		region contents, each at an IMAGE_ALIGN file offset
+ *
+ * ROM regions whose address, size and file offset are whole host pages
+ * are mapped straight from the file, so every board started from the
+ * same image shares their pages in the host page cache.
+ */
+#define IMAGE_MAGIC		"M68B"
+#define IMAGE_VERSION	1
+#define IMAGE_ALIGN		4096
+
+/* Device types */
+#define IMAGE_DEV_UART	1
+#define IMAGE_DEV_ACIA	2
+#define IMAGE_DEV_TIMER	3
+
+/* Region flags */
+#define IMAGE_REGION_ROM	0x01		/* Contents are only read, so may be mapped from the file */
+
+/**
+ * A block of memory stored in an image
+ */
+typedef struct IMAGE_REGION {
+	uint32_t		addr;					///< First address
+	uint32_t		size;					///< Bytes
+	uint32_t		flags;					///< IMAGE_REGION_ flags
+} IMAGE_REGION;
+
+int image_write(const char *filename, const BOARD_CONFIG *config, const uint8_t *mem,
+	const IMAGE_REGION *regions, int nregions);
+bool image_probe(const char *filename);
+BOARD_ROM *image_open(const char *filename, BOARD_CONFIG *config, const char **error);
+
+#endif
@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include <poll.h>	/* poll() */
+#include <pthread.h>
+#include <unistd.h>	/* pipe(), read(), write() */
+
+#include "input.h"
+#include "ring.h"
+
+/* how long to wait for the emulator to drain a full ring, in ms */
+#define FULL_WAIT	10
+
+
+struct INPUT {
+	int			fd;						///< Descriptor to read
+	int			wake[2];				///< Pipe used by input_stop() to wake the reader
+	pthread_t	thread;
+	bool		running;				///< Reader thread exists
+	RING		ring;
+};
+
+
+static void *
+reader(void *arg)
+{
+	INPUT *input = arg;
+	struct pollfd fds[2];
+	bool eof = false;
+
+	fds[0].fd = input->wake[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = input->fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		uint32_t space = RING_SIZE - (atomic_load(&input->ring.head) - atomic_load(&input->ring.tail));
+		uint8_t buf[256];
+		ssize_t i, n;
+
+		/* only read what the ring can take; leave the rest with the host */
+		if (poll(fds, (eof || space == 0) ? 1 : 2, space == 0 ? FULL_WAIT : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents)
+			break;
+		if (eof || space == 0 || !fds[1].revents)
+			continue;
+
+		n = read(input->fd, buf, space < sizeof(buf) ? space : sizeof(buf));
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n <= 0) {
+			eof = true;
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			ring_put(&input->ring, buf[i]);
+	}
+	return NULL;
+}
+
+INPUT *
+input_new(int fd)
+{
+	INPUT *input = calloc(1, sizeof(INPUT));
+
+	if (input == NULL)
+		return NULL;
+	if (pipe(input->wake) < 0) {
+		free(input);
+		return NULL;
+	}
+	input->fd = fd;
+	ring_init(&input->ring);
+	return input;
+}
+
+void
+input_destroy(INPUT *input)
+{
+	if (input == NULL)
+		return;
+	input_stop(input);
+	close(input->wake[0]);
+	close(input->wake[1]);
+	free(input);
+}
+
+/**
+ * Start the reader thread.
+ *
+ * @return	0 on success, -1 if the thread cannot be created
+ */
+int
+input_start(INPUT *input)
+{
+	if (input->running)
+		return 0;
+	if (pthread_create(&input->thread, NULL, reader, input) != 0)
+		return -1;
+	input->running = true;
+	return 0;
+}
+
+/**
+ * Stop the reader thread, leaving the descriptor to the caller.
+ *
+ * Bytes already queued stay in the ring for the next input_get().
+ */
+void
+input_stop(INPUT *input)
+{
+	char ch = 0;
+	ssize_t n;
+
+	if (!input->running)
+		return;
+	do {
+		n = write(input->wake[1], &ch, 1);
+	} while (n < 0 && errno == EINTR);
+	pthread_join(input->thread, NULL);
+	n = read(input->wake[0], &ch, 1);	/* drain the wakeup */
+	(void)n;
+	input->running = false;
+}
+
+/**
+ * Take the oldest queued input byte, without blocking.
+ *
+ * @return	false if there is none
+ */
+bool
+input_get(INPUT *input, uint8_t *ch)
+{
+	return ring_get(&input->ring, ch);
+}
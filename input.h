@@ -0,0 +1,23 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Asynchronous host input.
+ *
+ * While started, a reader thread blocks in poll() on the input descriptor
+ * and queues whatever arrives in a lock-free ring. The emulator drains the
+ * ring between quanta with input_get(), so it never makes a system call to
+ * look for input and latency is bounded by the quantum.
+ */
+typedef struct INPUT INPUT;
+
+INPUT *input_new(int fd);
+void input_destroy(INPUT *input);
+int input_start(INPUT *input);
+void input_stop(INPUT *input);
+bool input_get(INPUT *input, uint8_t *ch);
+
+#endif
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loader.h"
+
+/* longest record: a count byte and up to 255 more */
+#define MAX_RECORD	256
+
+
+/*
+ * Hex digit values plus one, so that zero marks anything that is not a
+ * hex digit.
+ */
+static const uint8_t hex_table[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/*
+ * Decode 'n' bytes from 2n hex digits.
+ *
+ * @return	0, or -1 if a character is not a hex digit
+ */
+static inline int
+decode_hex(const char *p, uint8_t *out, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		const uint8_t hi = hex_table[(uint8_t)p[2 * i]];
+		const uint8_t lo = hex_table[(uint8_t)p[2 * i + 1]];
+
+		if (hi == 0 || lo == 0)
+			return -1;
+		out[i] = ((hi - 1) << 4) | (lo - 1);
+	}
+	return 0;
+}
+
+static int
+fail(LOADER *ld, unsigned line, const char *error)
+{
+	ld->error = error;
+	ld->line = line;
+	return -1;
+}
+
+static int
+store(LOADER *ld, unsigned line, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	if (len == 0)
+		return 0;
+	if (addr >= ld->size || len > ld->size - addr)
+		return fail(ld, line, "address beyond memory");
+
+	memcpy(ld->mem + addr, data, len);
+	if (ld->bytes == 0 || addr < ld->low)
+		ld->low = addr;
+	if (addr + len > ld->high)
+		ld->high = addr + len;
+	ld->bytes += len;
+	return 0;
+}
+
+static uint32_t
+get_addr(const uint8_t *p, int n)
+{
+	uint32_t addr = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		addr = (addr << 8) | p[i];
+	return addr;
+}
+
+/*
+ * One S-record: Stcc[aaaa..][dd..]ss, where cc counts the address, data
+ * and checksum bytes, and ss is the ones' complement of the sum of all of
+ * them and cc.
+ */
+static int
+srec_line(LOADER *ld, unsigned line, const char *p, size_t len)
+{
+	/* address bytes by record type; 0 marks S4, which is reserved */
+	static const uint8_t addr_len[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+	uint8_t rec[MAX_RECORD];
+	unsigned sum = 0, type, alen, i;
+
+	if (len < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9')
+		return fail(ld, line, "not an S-record");
+	type = p[1] - '0';
+	alen = addr_len[type];
+	if (alen == 0)
+		return fail(ld, line, "unknown S-record type");
+
+	if (decode_hex(p + 2, rec, 1) < 0)
+		return fail(ld, line, "bad hex digit");
+	if (len != 4 + 2 * (size_t)rec[0] || rec[0] < alen + 1)
+		return fail(ld, line, "record length does not match its count");
+	if (decode_hex(p + 4, rec + 1, rec[0]) < 0)
+		return fail(ld, line, "bad hex digit");
+
+	for (i = 0; i <= rec[0]; i++)
+		sum += rec[i];
+	if ((sum & 0xff) != 0xff)
+		return fail(ld, line, "checksum mismatch");
+
+	switch (type) {
+		case 1:
+		case 2:
+		case 3:
+			return store(ld, line, get_addr(rec + 1, alen), rec + 1 + alen, rec[0] - alen - 1);
+		case 7:
+		case 8:
+		case 9:
+			ld->entry = get_addr(rec + 1, alen);
+			ld->has_entry = true;
+			break;
+		default:
+			// S0 header, S5/S6 record counts
+			break;
+	}
+	return 0;
+}
+
+/*
+ * One Intel HEX record: :ccaaaatt[dd..]ss, where the bytes sum to zero.
+ *
+ * @return	1 for the end-of-file record, 0 for any other, -1 on error
+ */
+static int
+ihex_line(LOADER *ld, unsigned line, const char *p, size_t len, uint32_t *base)
+{
+	uint8_t rec[MAX_RECORD + 4];
+	unsigned sum = 0, n, i;
+
+	if (p[0] != ':')
+		return fail(ld, line, "not an Intel HEX record");
+	if (len < 11 || (len & 1) == 0)
+		return fail(ld, line, "record length does not match its count");
+	n = (len - 1) / 2;
+	if (decode_hex(p + 1, rec, 1) < 0)
+		return fail(ld, line, "bad hex digit");
+	if (n != rec[0] + 5u)
+		return fail(ld, line, "record length does not match its count");
+	if (decode_hex(p + 3, rec + 1, n - 1) < 0)
+		return fail(ld, line, "bad hex digit");
+
+	for (i = 0; i < n; i++)
+		sum += rec[i];
+	if ((sum & 0xff) != 0)
+		return fail(ld, line, "checksum mismatch");
+
+	switch (rec[3]) {
+		case 0x00:	// data
+			return store(ld, line, *base + get_addr(rec + 1, 2), rec + 4, rec[0]);
+		case 0x01:	// end of file
+			return 1;
+		case 0x02:	// extended segment address
+			if (rec[0] != 2)
+				return fail(ld, line, "bad extended address record");
+			*base = get_addr(rec + 4, 2) << 4;
+			break;
+		case 0x03:	// start segment address, CS:IP
+			if (rec[0] != 4)
+				return fail(ld, line, "bad start address record");
+			ld->entry = (get_addr(rec + 4, 2) << 4) + get_addr(rec + 6, 2);
+			ld->has_entry = true;
+			break;
+		case 0x04:	// extended linear address
+			if (rec[0] != 2)
+				return fail(ld, line, "bad extended address record");
+			*base = get_addr(rec + 4, 2) << 16;
+			break;
+		case 0x05:	// start linear address
+			if (rec[0] != 4)
+				return fail(ld, line, "bad start address record");
+			ld->entry = get_addr(rec + 4, 4);
+			ld->has_entry = true;
+			break;
+		default:
+			return fail(ld, line, "unknown Intel HEX record type");
+	}
+	return 0;
+}
+
+/**
+ * Prepare to load into 'size' bytes at 'mem'.
+ */
+void
+loader_init(LOADER *ld, uint8_t *mem, uint32_t size)
+{
+	memset(ld, 0, sizeof(*ld));
+	ld->mem = mem;
+	ld->size = size;
+}
+
+/**
+ * Guess the format of an image from its first non-blank character.
+ */
+LOADER_FORMAT
+loader_detect(const char *data, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n'))
+		i++;
+	if (i + 1 < len && data[i] == 'S' && data[i + 1] >= '0' && data[i + 1] <= '9')
+		return LOADER_SREC;
+	if (i + 1 < len && data[i] == ':' && hex_table[(uint8_t)data[i + 1]] != 0)
+		return LOADER_IHEX;
+	return LOADER_BINARY;
+}
+
+/**
+ * Load an image held in memory. Text images may have blank lines and
+ * CRLF line endings; every record must be well formed and its checksum
+ * correct.
+ *
+ * @return	0 on success, -1 on error with ld->error (and ld->line) set
+ */
+int
+loader_load_buffer(LOADER *ld, const char *data, size_t len, LOADER_FORMAT format)
+{
+	const char *p = data, *end = data + len;
+	uint32_t base = 0;
+	unsigned line = 0;
+
+	if (format == LOADER_AUTO)
+		format = loader_detect(data, len);
+	if (format == LOADER_BINARY)
+		return store(ld, 0, ld->offset, (const uint8_t *)data, len);
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		const char *next = eol ? eol + 1 : end;
+		size_t n;
+		int rc;
+
+		if (eol == NULL)
+			eol = end;
+		line++;
+		while (eol > p && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t'))
+			eol--;
+		n = eol - p;
+		if (n == 0) {
+			p = next;
+			continue;
+		}
+
+		if (format == LOADER_SREC) {
+			rc = srec_line(ld, line, p, n);
+		} else {
+			rc = ihex_line(ld, line, p, n, &base);
+			if (rc > 0)
+				break;
+		}
+		if (rc < 0)
+			return -1;
+		p = next;
+	}
+	return 0;
+}
+
+/**
+ * Load an image file.
+ *
+ * @return	0 on success, -1 on error with ld->error (and ld->line) set
+ */
+int
+loader_load_file(LOADER *ld, const char *filename, LOADER_FORMAT format)
+{
+	FILE *f;
+	char *data;
+	long len;
+	int rc;
+
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return fail(ld, 0, "cannot open file");
+	if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0) {
+		fclose(f);
+		return fail(ld, 0, "cannot read file");
+	}
+
+	data = malloc(len ? len : 1);
+	if (data == NULL) {
+		fclose(f);
+		return fail(ld, 0, "out of memory");
+	}
+	if (fread(data, 1, len, f) != (size_t)len) {
+		free(data);
+		fclose(f);
+		return fail(ld, 0, "cannot read file");
+	}
+	fclose(f);
+
+	rc = loader_load_buffer(ld, data, len, format);
+	free(data);
+	return rc;
+}
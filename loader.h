@@ -0,0 +1,41 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Image file formats understood by the loader
+ */
+typedef enum {
+	LOADER_AUTO,			///< Decide from the contents: 'S' for S-records, ':' for Intel HEX, else binary
+	LOADER_SREC,			///< Motorola S-records, S1/S2/S3 data with S7/S8/S9 start addresses
+	LOADER_IHEX,			///< Intel HEX, with extended segment and linear addresses
+	LOADER_BINARY			///< Raw bytes, loaded at LOADER::offset
+} LOADER_FORMAT;
+
+/**
+ * Image loader state.
+ *
+ * Fill in the destination before loading; the rest describes the image
+ * once it has loaded, or the reason it did not.
+ */
+typedef struct LOADER {
+	uint8_t *		mem;					///< Destination memory, indexed by address
+	uint32_t		size;					///< Size of mem in bytes; records beyond it are an error
+	uint32_t		offset;					///< Load address for binary images
+	uint32_t		low, high;				///< Lowest address loaded and one past the highest
+	uint32_t		bytes;					///< Data bytes loaded
+	uint32_t		entry;					///< Start address, if has_entry
+	bool			has_entry;				///< The image gave a start address
+	const char *	error;					///< Reason for failure
+	unsigned		line;					///< Line of the failure, 0 if not tied to a line
+} LOADER;
+
+void loader_init(LOADER *ld, uint8_t *mem, uint32_t size);
+LOADER_FORMAT loader_detect(const char *data, size_t len);
+int loader_load_buffer(LOADER *ld, const char *data, size_t len, LOADER_FORMAT format);
+int loader_load_file(LOADER *ld, const char *filename, LOADER_FORMAT format);
+
+#endif
@@ -0,0 +1,299 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "m68emu.h"
+#include "m68_internal.h"
+
+
+/// Maximum number of instructions in a translated block
+#define MAX_BLOCK_UOPS	32
+
+/// Block arena size; the whole cache is flushed when it fills up
+#define ARENA_SIZE		(256 * 1024)
+
+/// Largest possible block, in bytes of arena
+#define MAX_BLOCK_SIZE	(sizeof(M68_BLOCK) + MAX_BLOCK_UOPS * sizeof(M68_UOP))
+
+
+/**
+ * Allocate the block cache.
+ */
+bool m68_blocks_alloc(M68_CTX *ctx)
+{
+	M68_BLOCKS *blocks;
+
+	if (!m68_code_map_alloc(ctx)) {
+		return false;
+	}
+
+	blocks = calloc(1, sizeof(M68_BLOCKS));
+	if (blocks == NULL) {
+		return false;
+	}
+	blocks->map = calloc((size_t)ctx->pc_and + 1, sizeof(M68_BLOCK *));
+	blocks->arena = malloc(ARENA_SIZE);
+	blocks->size = ARENA_SIZE;
+	if (blocks->map == NULL || blocks->arena == NULL) {
+		free(blocks->map);
+		free(blocks->arena);
+		free(blocks);
+		return false;
+	}
+
+	ctx->blocks = blocks;
+	return true;
+}
+
+/**
+ * Discard all translated blocks.
+ *
+ * Writes through the core flush the cache automatically when they hit
+ * translated code; call this after changing emulated memory behind the
+ * core's back (e.g. reloading an image).
+ */
+void m68_blocks_flush(M68_CTX *ctx)
+{
+	M68_BLOCKS *blocks = ctx->blocks;
+	uint32_t addr;
+
+	if (blocks == NULL) {
+		return;
+	}
+	memset(blocks->map, 0, ((size_t)ctx->pc_and + 1) * sizeof(M68_BLOCK *));
+	blocks->used = 0;
+	blocks->generation++;
+	for (addr = 0; addr <= ctx->pc_and; addr++) {
+		ctx->code_map[addr] &= ~M68_CODE_BLOCK;
+	}
+}
+
+/**
+ * Does this instruction end a block?
+ *
+ * Blocks end at anything that can change the flow of control, so every
+ * instruction but the last falls through to the next.
+ */
+static bool ends_block(const M68_OPTABLE_ENT *opcode)
+{
+	switch (opcode->amode) {
+		case AMODE_DIRECT_REL:
+		case AMODE_DIRECT_JUMP:
+		case AMODE_EXTENDED_JUMP:
+		case AMODE_INDEXED0_JUMP:
+		case AMODE_INDEXED1_JUMP:
+		case AMODE_INDEXED2_JUMP:
+		case AMODE_RELATIVE:
+		case AMODE_ILLEGAL:
+			return true;
+
+		case AMODE_INHERENT:
+			return (strcmp(opcode->mnem, "RTS") == 0 ||
+					strcmp(opcode->mnem, "RTI") == 0 ||
+					strcmp(opcode->mnem, "SWI") == 0 ||
+					strcmp(opcode->mnem, "WAIT") == 0 ||
+					strcmp(opcode->mnem, "STOP") == 0);
+
+		default:
+			return false;
+	}
+}
+
+/**
+ * Can this instruction appear in a polling loop?
+ *
+ * Allows anything that only reads memory and changes registers and flags;
+ * rejects memory writes, stack operations and changes to the I bit.
+ */
+static bool reads_only(const M68_OPTABLE_ENT *opcode)
+{
+	static const char *const mem_read[] = {
+		"ADC", "ADD", "AND", "BIT", "CMP", "CPX", "EOR", "LDA", "LDX",
+		"ORA", "SBC", "SUB", "TST", NULL
+	};
+	static const char *const inherent[] = {
+		"CLC", "MUL", "NOP", "RSP", "SEC", "TAX", "TXA", NULL
+	};
+	const char *const *list;
+	int i;
+
+	switch (opcode->amode) {
+		case AMODE_IMMEDIATE:
+		case AMODE_INHERENT_A:
+		case AMODE_INHERENT_X:
+		case AMODE_DIRECT_REL:
+			return true;
+
+		case AMODE_RELATIVE:
+			return strcmp(opcode->mnem, "BSR") != 0;
+
+		case AMODE_DIRECT:
+		case AMODE_EXTENDED:
+		case AMODE_INDEXED0:
+		case AMODE_INDEXED1:
+		case AMODE_INDEXED2:
+			list = mem_read;
+			break;
+
+		case AMODE_INHERENT:
+			list = inherent;
+			break;
+
+		default:
+			return false;
+	}
+
+	for (i = 0; list[i] != NULL; i++) {
+		if (strcmp(opcode->mnem, list[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Is this block a countdown loop: one DECA, DECX or DEC dir, any number of
+ * NOPs, and a BNE back to the entry?
+ *
+ * @return	The M68_LOOP_COUNT_* kind, or M68_LOOP_NONE
+ */
+static M68_LOOP countdown_kind(const M68_OPTABLE_ENT *optable, M68_BLOCK *blk)
+{
+	M68_LOOP kind = M68_LOOP_NONE;
+	int i;
+
+	if (strcmp(optable[blk->uops[blk->count - 1].opval].mnem, "BNE") != 0) {
+		return M68_LOOP_NONE;
+	}
+
+	for (i = 0; i < blk->count - 1; i++) {
+		const M68_OPTABLE_ENT *opcode = &optable[blk->uops[i].opval];
+		M68_LOOP k;
+
+		if (strcmp(opcode->mnem, "NOP") == 0) {
+			continue;
+		} else if (strcmp(opcode->mnem, "DECA") == 0) {
+			k = M68_LOOP_COUNT_A;
+		} else if (strcmp(opcode->mnem, "DECX") == 0) {
+			k = M68_LOOP_COUNT_X;
+		} else if (strcmp(opcode->mnem, "DEC") == 0 && opcode->amode == AMODE_DIRECT) {
+			k = M68_LOOP_COUNT_MEM;
+			blk->loop_addr = blk->uops[i].ea;
+		} else {
+			return M68_LOOP_NONE;
+		}
+		if (kind != M68_LOOP_NONE) {
+			return M68_LOOP_NONE;
+		}
+		kind = k;
+	}
+	return kind;
+}
+
+/**
+ * Classify a block that branches back to its own entry.
+ */
+static M68_LOOP loop_kind(const M68_OPTABLE_ENT *optable, M68_BLOCK *blk)
+{
+	const M68_UOP *last = &blk->uops[blk->count - 1];
+	M68_LOOP kind;
+	int i;
+
+	switch (optable[last->opval].amode) {
+		case AMODE_RELATIVE:
+		case AMODE_DIRECT_REL:
+			if (last->target != blk->pc) {
+				return M68_LOOP_NONE;
+			}
+			break;
+		default:
+			return M68_LOOP_NONE;
+	}
+
+	kind = countdown_kind(optable, blk);
+	if (kind != M68_LOOP_NONE) {
+		return kind;
+	}
+
+	for (i = 0; i < blk->count; i++) {
+		if (!reads_only(&optable[blk->uops[i].opval])) {
+			return M68_LOOP_NONE;
+		}
+	}
+	return M68_LOOP_POLL;
+}
+
+/**
+ * Translate the straight-line run of instructions starting at 'pc'.
+ *
+ * @return	The new block, or NULL if the first instruction cannot be
+ *			predecoded (e.g. it is fetched from an I/O page)
+ */
+M68_BLOCK *m68_block_translate(M68_CTX *ctx, const uint16_t pc)
+{
+	M68_BLOCKS *blocks = ctx->blocks;
+	M68_OPTABLE_ENT *optable;
+	M68_BLOCK *blk;
+	uint16_t addr = pc;
+	int i;
+
+	switch (ctx->cpuType) {
+		case M68_CPU_HC05C4:
+			optable = m68hc05_optable;
+			break;
+		default:
+			assert(0);
+			return NULL;
+	}
+
+	if (blocks->size - blocks->used < MAX_BLOCK_SIZE) {
+		m68_blocks_flush(ctx);
+	}
+	blk = (M68_BLOCK *)(blocks->arena + blocks->used);
+	blk->pc = pc;
+	blk->count = 0;
+	blk->cycles = 0;
+
+	while (blk->count < MAX_BLOCK_UOPS && addr <= ctx->pc_and) {
+		M68_UOP *uop = &blk->uops[blk->count];
+
+		if (!m68_uop_decode(ctx, uop, addr)) {
+			break;
+		}
+		// Illegal instructions get a block to themselves, so a block
+		// either runs to completion or reports the illegal opcode.
+		if (optable[uop->opval].amode == AMODE_ILLEGAL && blk->count > 0) {
+			break;
+		}
+		blk->count++;
+		blk->cycles += uop->cycles;
+		addr = uop->next;
+
+		if (ends_block(&optable[uop->opval])) {
+			break;
+		}
+	}
+
+	if (blk->count == 0) {
+		return NULL;
+	}
+	blk->loop = loop_kind(optable, blk);
+
+	// Commit the block and note which bytes it was translated from
+	blocks->used += sizeof(M68_BLOCK) + blk->count * sizeof(M68_UOP);
+	blocks->used = (blocks->used + 7) & ~(size_t)7;
+	blocks->map[pc] = blk;
+	for (i = 0; i < blk->count; i++) {
+		int b;
+
+		for (b = 0; b < blk->uops[i].len; b++) {
+			uint16_t a = blk->uops[i].pc + b;
+
+			if (a <= ctx->pc_and) {
+				ctx->code_map[a] |= M68_CODE_BLOCK;
+			}
+		}
+	}
+
+	return blk;
+}
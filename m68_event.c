@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include "m68emu.h"
+#include "m68_internal.h"
+
+
+/**
+ * Recompute the earliest pending event time.
+ */
+static void update_next_event(M68_CTX *ctx)
+{
+	uint64_t next = M68_NEVER;
+	int i;
+
+	for (i = 0; i < ctx->nevents; i++) {
+		if (ctx->events[i].when < next) {
+			next = ctx->events[i].when;
+		}
+	}
+	ctx->next_event = next;
+}
+
+/**
+ * Register an event callback.
+ *
+ * Peripherals use events to do their work at the cycle it falls due
+ * instead of on every instruction. A new event starts unscheduled.
+ *
+ * @param	ctx		Emulation context
+ * @param	func	Called from m68_run()/m68_exec_cycle() once the event is due
+ * @param	user	Passed to 'func'
+ * @return	Event id for m68_event_schedule(), or -1 if the table is full
+ */
+int m68_event_register(M68_CTX *ctx, M68_EVENT_F func, void *user)
+{
+	M68_EVENT *ev;
+
+	if (ctx->nevents >= M68_MAX_EVENTS) {
+		return -1;
+	}
+	ev = &ctx->events[ctx->nevents];
+	ev->when = M68_NEVER;
+	ev->func = func;
+	ev->user = user;
+	return ctx->nevents++;
+}
+
+/**
+ * Schedule (or reschedule) an event.
+ *
+ * May be called from memory callbacks and event callbacks; if the new time
+ * falls inside the current m68_run() slice, the slice is cut short so the
+ * event fires on time.
+ *
+ * @param	ctx		Emulation context
+ * @param	id		Event id from m68_event_register()
+ * @param	when	Absolute cycle count (see ctx->cycles), or M68_NEVER to cancel
+ */
+void m68_event_schedule(M68_CTX *ctx, const int id, const uint64_t when)
+{
+	ctx->events[id].when = when;
+	update_next_event(ctx);
+	if (when < ctx->deadline) {
+		ctx->deadline = when;
+	}
+}
+
+/**
+ * Restart the oscillator after STOP.
+ *
+ * Peripherals did not run while the CPU was stopped, so every scheduled
+ * event moves back by the time spent stopped.
+ */
+void m68_clock_resume(M68_CTX *ctx)
+{
+	const uint64_t stopped = ctx->cycles - ctx->stopped_since;
+	int i;
+
+	for (i = 0; i < ctx->nevents; i++) {
+		if (ctx->events[i].when != M68_NEVER) {
+			ctx->events[i].when += stopped;
+		}
+	}
+	ctx->halted_cycles += stopped;
+	ctx->is_stopped = false;
+	update_next_event(ctx);
+}
+
+/**
+ * Fire every event that is due.
+ *
+ * Engines only stop between instructions (or blocks), so an event may
+ * fire a few cycles after its scheduled time; callbacks should work from
+ * ctx->cycles rather than assume they run exactly on time.
+ */
+void m68_event_dispatch(M68_CTX *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->nevents; i++) {
+		M68_EVENT *ev = &ctx->events[i];
+
+		if (ev->when <= ctx->cycles) {
+			// Unschedule first so the callback can reschedule
+			ev->when = M68_NEVER;
+			ev->func(ctx, ev->user);
+		}
+	}
+	update_next_event(ctx);
+}
@@ -0,0 +1,241 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "m68emu.h"
+#include "m68_internal.h"
+
+
+/// Number of operand bytes following the opcode, per addressing mode
+static const uint8_t operand_bytes[AMODE_MAX] = {
+	[AMODE_DIRECT]			= 1,
+	[AMODE_DIRECT_REL]		= 2,
+	[AMODE_DIRECT_JUMP]		= 1,
+	[AMODE_EXTENDED]		= 2,
+	[AMODE_EXTENDED_JUMP]	= 2,
+	[AMODE_IMMEDIATE]		= 1,
+	[AMODE_INDEXED0]		= 0,
+	[AMODE_INDEXED0_JUMP]	= 0,
+	[AMODE_INDEXED1]		= 1,
+	[AMODE_INDEXED1_JUMP]	= 1,
+	[AMODE_INDEXED2]		= 2,
+	[AMODE_INDEXED2_JUMP]	= 2,
+	[AMODE_INHERENT]		= 0,
+	[AMODE_INHERENT_A]		= 0,
+	[AMODE_INHERENT_X]		= 0,
+	[AMODE_RELATIVE]		= 1,
+	[AMODE_ILLEGAL]			= 0,
+};
+
+/**
+ * Read a byte of code without side effects.
+ *
+ * Only pages mapped for direct reads can be decoded ahead of execution;
+ * going through read_mem could touch I/O registers.
+ *
+ * @return	false if the address is not in a mapped page
+ */
+static inline bool fetch_code(M68_CTX *ctx, const uint16_t addr, uint8_t *value)
+{
+	uint8_t *page = ctx->mem_rd[addr >> M68_PAGE_SHIFT];
+
+	if (page == NULL) {
+		return false;
+	}
+	*value = page[addr & (M68_PAGE_SIZE - 1)];
+	return true;
+}
+
+/**
+ * Decode the instruction at 'pc' into a uop.
+ *
+ * @param	ctx		Emulation context
+ * @param	uop		Entry to fill in
+ * @param	pc		Address of the instruction
+ * @return	false if the instruction cannot be predecoded, in which case
+ *			uop->exec is left untouched
+ */
+bool m68_uop_decode(M68_CTX *ctx, M68_UOP *uop, const uint16_t pc)
+{
+	M68_OPTABLE_ENT *optable;
+	M68_UOP_F *uops;
+	uint8_t opval;
+	uint8_t b[2] = { 0, 0 };
+	int i, n;
+
+	switch (ctx->cpuType) {
+		case M68_CPU_HC05C4:
+			optable = m68hc05_optable;
+			uops = m68hc05_uops;
+			break;
+		default:
+			assert(0);
+			return false;
+	}
+
+	if (!fetch_code(ctx, pc, &opval)) {
+		return false;
+	}
+	if (ctx->opdecode != NULL) {
+		opval = ctx->opdecode(ctx, opval);
+	}
+
+	M68_OPTABLE_ENT *opcode = &optable[opval];
+	n = operand_bytes[opcode->amode];
+	for (i = 0; i < n; i++) {
+		if (!fetch_code(ctx, pc + 1 + i, &b[i])) {
+			return false;
+		}
+	}
+
+	uop->pc = pc;
+	uop->next = pc + 1 + n;
+	uop->opval = opval;
+	uop->cycles = opcode->cycles;
+	uop->len = 1 + n;
+	uop->ea = 0;
+	uop->target = 0;
+	uop->imm = 0;
+
+	switch (opcode->amode) {
+		case AMODE_DIRECT:
+		case AMODE_INDEXED1:
+		case AMODE_INDEXED1_JUMP:
+			uop->ea = b[0];
+			break;
+
+		case AMODE_DIRECT_JUMP:
+			uop->target = b[0];
+			break;
+
+		case AMODE_DIRECT_REL:
+			uop->ea = b[0];
+			uop->target = pc + 3 + (int8_t)b[1];
+			break;
+
+		case AMODE_EXTENDED:
+		case AMODE_INDEXED2:
+		case AMODE_INDEXED2_JUMP:
+			uop->ea = ((uint16_t)b[0] << 8) | b[1];
+			break;
+
+		case AMODE_EXTENDED_JUMP:
+			uop->target = ((uint16_t)b[0] << 8) | b[1];
+			break;
+
+		case AMODE_IMMEDIATE:
+			uop->imm = b[0];
+			break;
+
+		case AMODE_RELATIVE:
+			uop->target = pc + 2 + (int8_t)b[0];
+			break;
+
+		default:
+			// No static operands
+			break;
+	}
+
+	uop->exec = uops[opval];
+	return true;
+}
+
+/**
+ * Allocate the code map shared by the instruction and block caches.
+ */
+bool m68_code_map_alloc(M68_CTX *ctx)
+{
+	if (ctx->code_map == NULL) {
+		ctx->code_map = calloc((size_t)ctx->pc_and + 1, 1);
+	}
+	return ctx->code_map != NULL;
+}
+
+/**
+ * Handle a write to an address holding cached code.
+ *
+ * Called by m68_write_byte() when the code map says a cache holds a
+ * decoded copy of 'addr'.
+ */
+void m68_code_invalidate(M68_CTX *ctx, const uint16_t addr)
+{
+	int k;
+
+	if (ctx->code_map[addr] & M68_CODE_ICACHE) {
+		// HC05 instructions are at most three bytes long, so only the
+		// entries at addr, addr-1 and addr-2 can cover it.
+		for (k = 0; k < 3; k++) {
+			uint16_t pc = addr - k;
+			M68_UOP *uop;
+
+			if (pc > ctx->pc_and) {
+				continue;
+			}
+			uop = &ctx->icache[pc];
+			if (uop->exec != NULL && uop->len > k) {
+				uop->exec = NULL;
+			}
+		}
+		ctx->code_map[addr] &= ~M68_CODE_ICACHE;
+	}
+
+	if (ctx->code_map[addr] & M68_CODE_BLOCK) {
+		// Blocks can share code bytes; drop the lot
+		m68_blocks_flush(ctx);
+	}
+}
+
+/**
+ * Allocate the instruction cache, one entry per address in the PC range.
+ */
+bool m68_icache_alloc(M68_CTX *ctx)
+{
+	if (!m68_code_map_alloc(ctx)) {
+		return false;
+	}
+	ctx->icache = calloc((size_t)ctx->pc_and + 1, sizeof(M68_UOP));
+	return ctx->icache != NULL;
+}
+
+/**
+ * Decode the instruction at 'pc' into the instruction cache.
+ *
+ * @return	false if the instruction cannot be predecoded
+ */
+bool m68_icache_fill(M68_CTX *ctx, const uint16_t pc)
+{
+	M68_UOP *uop = &ctx->icache[pc];
+	int i;
+
+	if (!m68_uop_decode(ctx, uop, pc)) {
+		return false;
+	}
+	for (i = 0; i < uop->len; i++) {
+		uint16_t addr = pc + i;
+
+		if (addr <= ctx->pc_and) {
+			ctx->code_map[addr] |= M68_CODE_ICACHE;
+		}
+	}
+	return true;
+}
+
+/**
+ * Discard all cached instructions.
+ *
+ * Writes through the core invalidate the cache automatically; call this
+ * after changing emulated memory behind the core's back (e.g. reloading
+ * an image).
+ */
+void m68_icache_flush(M68_CTX *ctx)
+{
+	uint32_t addr;
+
+	if (ctx->icache == NULL) {
+		return;
+	}
+	memset(ctx->icache, 0, ((size_t)ctx->pc_and + 1) * sizeof(M68_UOP));
+	for (addr = 0; addr <= ctx->pc_and; addr++) {
+		ctx->code_map[addr] &= ~M68_CODE_ICACHE;
+	}
+}
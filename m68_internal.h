@@ -1,6 +1,7 @@
 #ifndef M68_INTERNAL_H
 #define M68_INTERNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 //! Addressing modes
@@ -37,11 +38,259 @@ typedef struct M68_OPTABLE_ENT {
 
 extern M68_OPTABLE_ENT m68hc05_optable[256];
 
+/**
+ * Specialized opcode handler, generated by makeoptab.py.
+ *
+ * Called with pc_next pointing after the opcode byte; fetches its own
+ * operands, executes and writes back.
+ *
+ * @return	Number of cycles executed, or -1 for an illegal instruction
+ */
+typedef int (*M68_HANDLER_F)(M68_CTX *ctx);
+
+extern M68_HANDLER_F m68hc05_handlers[256];
+
+int m68_illegal(M68_CTX *ctx, const uint8_t opval);
+
+/**
+ * Predecoded instruction, as held in the instruction cache
+ */
+typedef struct M68_UOP {
+	int (*exec)(M68_CTX *ctx, const struct M68_UOP *uop);	///< Specialized handler, NULL if the entry is empty
+	uint16_t		pc;			///< Address of this instruction
+	uint16_t		next;		///< Address of the following instruction
+	uint16_t		ea;			///< Static effective address, or base/offset for indexed modes
+	uint16_t		target;		///< Static branch/jump target
+	uint8_t			imm;		///< Immediate operand
+	uint8_t			opval;		///< Opcode (after opdecode)
+	uint8_t			cycles;		///< Number of cycles to execute
+	uint8_t			len;		///< Instruction length in bytes
+} M68_UOP;
+
+/**
+ * Predecoded-instruction handler, generated by makeoptab.py.
+ *
+ * Called with reg_pc and pc_next already set from the uop.
+ *
+ * @return	Number of cycles executed, or -1 for an illegal instruction
+ */
+typedef int (*M68_UOP_F)(M68_CTX *ctx, const M68_UOP *uop);
+
+extern M68_UOP_F m68hc05_uops[256];
+
+bool m68_uop_decode(M68_CTX *ctx, M68_UOP *uop, const uint16_t pc);
+
+// code_map flags: which caches hold a decoded copy of the byte
+#define M68_CODE_ICACHE		0x01
+#define M68_CODE_BLOCK		0x02
+
+bool m68_code_map_alloc(M68_CTX *ctx);
+void m68_code_invalidate(M68_CTX *ctx, const uint16_t addr);
+bool m68_icache_alloc(M68_CTX *ctx);
+bool m68_icache_fill(M68_CTX *ctx, const uint16_t pc);
+
+/**
+ * Self-loop idioms recognised by the block translator
+ */
+typedef enum {
+	M68_LOOP_NONE,				///< Not a recognised loop
+	M68_LOOP_POLL,				///< Branches back to itself and never writes
+	M68_LOOP_COUNT_A,			///< DECA / BNE countdown
+	M68_LOOP_COUNT_X,			///< DECX / BNE countdown
+	M68_LOOP_COUNT_MEM,			///< DEC dir / BNE countdown
+} M68_LOOP;
+
+/**
+ * Translated block: a straight-line run of instructions ending at a
+ * control-flow instruction, executed as a unit.
+ */
+typedef struct M68_BLOCK {
+	uint16_t		pc;			///< Entry address
+	uint16_t		count;		///< Number of uops
+	uint32_t		cycles;		///< Sum of the uop cycle counts
+	uint8_t			loop;		///< M68_LOOP_* idiom, run specially by the block engine
+	uint16_t		loop_addr;	///< Counter address for M68_LOOP_COUNT_MEM
+	M68_UOP			uops[];		///< Predecoded instructions
+} M68_BLOCK;
+
+/**
+ * Block cache
+ */
+typedef struct M68_BLOCKS {
+	M68_BLOCK **	map;		///< Block by entry address, pc_and+1 entries
+	uint8_t *		arena;		///< Block storage
+	size_t			used;		///< Bytes of arena in use
+	size_t			size;		///< Arena size
+	uint32_t		generation;	///< Incremented on every flush
+} M68_BLOCKS;
+
+bool m68_blocks_alloc(M68_CTX *ctx);
+M68_BLOCK *m68_block_translate(M68_CTX *ctx, const uint16_t pc);
+
+void m68_event_dispatch(M68_CTX *ctx);
+void m68_clock_resume(M68_CTX *ctx);
+
+/**
+ * Control-flow change made by an opcode, for the profiler
+ */
+typedef enum {
+	M68_PROF_NONE,
+	M68_PROF_CALL,				///< JSR/BSR: the target is in pc_next
+	M68_PROF_RETURN,			///< RTS
+	M68_PROF_SWI,				///< SWI: the handler address is in pc_next
+	M68_PROF_RTI				///< RTI
+} M68_PROF_OP;
+
+/**
+ * Calling-context tree node: one routine reached through one chain of
+ * calls. Node 0 is the root, the code running from reset.
+ */
+typedef struct M68_PROF_NODE {
+	uint16_t		entry;		///< Routine entry address
+	uint16_t		site;		///< Address of the call (or interrupted instruction)
+	bool			interrupt;	///< Entered through an interrupt or SWI
+	uint16_t		depth;		///< Number of calls from the root
+	int				parent;		///< Parent node, -1 for the root
+	int				child;		///< First child, or -1
+	int				sibling;	///< Next child of the parent, or -1
+	uint64_t		calls;		///< Times entered
+	uint64_t		cycles;		///< Cycles spent in this routine itself
+	uint64_t		insns;		///< Instructions executed in this routine itself
+} M68_PROF_NODE;
+
+/**
+ * Profiler state, see m68_profile_enable()
+ */
+typedef struct M68_PROFILE {
+	uint64_t *		count;		///< Executions per PC, pc_and+1 entries
+	uint64_t *		cycles;		///< Cycles per PC
+	uint16_t *		owner;		///< Entry address of the routine last seen executing each PC
+	M68_PROF_NODE *	nodes;		///< Calling-context tree
+	int				nnodes, size;
+	int				current;	///< Node of the running routine
+	uint32_t		lost;		///< Calls not pushed (tree full or too deep), still to return
+	uint8_t			flow[256];	///< M68_PROF_OP of each opcode
+	struct M68_SYMBOL *symbols;	///< Sorted symbol table, or NULL
+	int				nsymbols;
+} M68_PROFILE;
+
+void m68_profile_free(M68_CTX *ctx);
+void m68_profile_update(M68_CTX *ctx, const M68_PROF_OP op);
+void m68_profile_interrupt(M68_CTX *ctx, const uint16_t site);
+
+/**
+ * Account for the instruction just executed at ctx->reg_pc, whose opcode
+ * was 'opval'.
+ *
+ * Called by the instrumented run loops with the profiler enabled; calls
+ * and returns are recognised here from the opcode, so the instruction
+ * bodies shared with the lean loops carry no profiler hooks.
+ */
+static inline void m68_profile_insn(M68_CTX *ctx, const uint8_t opval, const int cycles)
+{
+	M68_PROFILE *prof = ctx->profile;
+	M68_PROF_NODE *node = &prof->nodes[prof->current];
+	const uint16_t pc = ctx->reg_pc & ctx->pc_and;
+
+	prof->count[pc]++;
+	prof->cycles[pc] += cycles;
+	prof->owner[pc] = node->entry;
+	node->cycles += cycles;
+	node->insns++;
+	if (prof->flow[opval] != M68_PROF_NONE) {
+		m68_profile_update(ctx, prof->flow[opval]);
+	}
+}
+
+// Run loops are specialised by constant arguments; make sure the compiler
+// really does produce one copy per variant rather than a shared generic one.
+#if defined(__GNUC__)
+#define M68_ALWAYS_INLINE	inline __attribute__((always_inline))
+#else
+#define M68_ALWAYS_INLINE	inline
+#endif
+
+// Threaded-code dispatch needs the GCC/Clang labels-as-values extension.
+// Build with -DM68_NO_COMPUTED_GOTO to force the portable loop.
+#if defined(__GNUC__) && !defined(M68_NO_COMPUTED_GOTO)
+#define M68_HAVE_COMPUTED_GOTO
+M68_EXIT m68hc05_run_threaded(M68_CTX *ctx);
+#endif
+
+/**
+ * Read a byte of emulated memory.
+ *
+ * Pages mapped with m68_map_pages() are read directly, anything else goes
+ * through the read_mem callback.
+ */
+static inline uint8_t m68_read_byte(M68_CTX *ctx, const uint16_t addr)
+{
+	uint8_t *page = ctx->mem_rd[addr >> M68_PAGE_SHIFT];
+
+	if (page != NULL) {
+		return page[addr & (M68_PAGE_SIZE - 1)];
+	}
+	return ctx->read_mem(ctx, addr);
+}
+
+/**
+ * @return	true if a cache holds code decoded from 'addr' or any alias of it
+ */
+static inline bool m68_code_cached(const M68_CTX *ctx, const uint16_t addr)
+{
+	uint16_t a = addr;
+
+	if (ctx->code_map == NULL) {
+		return false;
+	}
+	do {
+		if (a <= ctx->pc_and && ctx->code_map[a] != 0) {
+			return true;
+		}
+		a = (uint16_t)(ctx->page_alias[a >> M68_PAGE_SHIFT] << M68_PAGE_SHIFT) | (addr & (M68_PAGE_SIZE - 1));
+	} while (a != addr);
+	return false;
+}
+
+/**
+ * Write a byte of emulated memory.
+ *
+ * Pages mapped with m68_map_pages() are written directly, anything else goes
+ * through the write_mem callback. Cached or translated instructions covering
+ * the address, or any alias of it given to m68_alias_pages(), are
+ * invalidated, so self-modifying code stays correct.
+ */
+static inline void m68_write_byte(M68_CTX *ctx, const uint16_t addr, const uint8_t data)
+{
+	uint8_t *page = ctx->mem_wr[addr >> M68_PAGE_SHIFT];
+
+	if (page != NULL) {
+		page[addr & (M68_PAGE_SIZE - 1)] = data;
+	} else {
+		ctx->write_mem(ctx, addr, data);
+	}
+
+	if (ctx->code_map != NULL) {
+		uint16_t a = addr;
+
+		// Code may have been cached under any alias of the byte
+		do {
+			if (a <= ctx->pc_and && ctx->code_map[a] != 0) {
+				m68_code_invalidate(ctx, a);
+			}
+			a = (uint16_t)(ctx->page_alias[a >> M68_PAGE_SHIFT] << M68_PAGE_SHIFT) | (addr & (M68_PAGE_SIZE - 1));
+		} while (a != addr);
+	}
+}
+
 // M68HC vector addresses.
 static const uint16_t _M68_RESET_VECTOR = 0xFFFE;
 static const uint16_t _M68_SWI_VECTOR   = 0xFFFC;
 static const uint16_t _M68_INT_VECTOR   = 0xFFFA;
 
-// TODO - need to have an m68_int function which allows vector address to be passed at runtime
+/// Cycles taken to stack the registers and fetch an interrupt vector
+#define M68_INT_CYCLES	10
+
+void m68_enter_interrupt(M68_CTX *ctx, const uint16_t vector);
 
 #endif // M68_INTERNAL_H
@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include "m68emu.h"
+
+
+/**
+ * Register handlers for a peripheral's registers.
+ *
+ * The peripheral claims 'size' addresses from 'addr'. Each claimed address
+ * records the handler's number in a table for its page, so finding the
+ * handler for an access is one lookup however many peripherals are
+ * registered; pages without registers have no table. The embedder's
+ * memory callbacks do the dispatch, see m68_io_find().
+ *
+ * @param	ctx		Emulation context
+ * @param	addr	First register address
+ * @param	size	Number of register addresses
+ * @param	read	Called for reads, or NULL to leave reads to memory
+ * @param	write	Called for writes, or NULL
+ * @param	dev		Passed to 'read' and 'write'
+ * @return	0, or -1 if the table is full, an address is already claimed or
+ *			out of memory
+ */
+int m68_io_register(M68_CTX *ctx, const uint16_t addr, const uint32_t size, M68_IO_READ_F read, M68_IO_WRITE_F write, void *dev)
+{
+	uint32_t a;
+
+	if (ctx->nio >= M68_MAX_IO || size == 0 || addr + size > 0x10000) {
+		return -1;
+	}
+
+	// Check and allocate everything first, so failure claims nothing
+	for (a = addr; a < addr + size; a++) {
+		const uint8_t *map = ctx->io_map[a >> M68_PAGE_SHIFT];
+
+		if (map != NULL && map[a & (M68_PAGE_SIZE - 1)] != 0) {
+			return -1;
+		}
+	}
+	for (a = addr; a < addr + size; a++) {
+		uint8_t **map = &ctx->io_map[a >> M68_PAGE_SHIFT];
+
+		if (*map == NULL && (*map = calloc(M68_PAGE_SIZE, 1)) == NULL) {
+			return -1;
+		}
+	}
+
+	ctx->io[ctx->nio].read = read;
+	ctx->io[ctx->nio].write = write;
+	ctx->io[ctx->nio].dev = dev;
+	ctx->nio++;
+	for (a = addr; a < addr + size; a++) {
+		ctx->io_map[a >> M68_PAGE_SHIFT][a & (M68_PAGE_SIZE - 1)] = ctx->nio;
+	}
+	return 0;
+}
@@ -43,42 +43,38 @@ typedef enum {
 } M68_CARRY_TYPE;
 
 /**
- * Update the CCR flag bits after an arithmetic operation.
+ * Compute CCR flag bits from an arithmetic operation.
  *
- * @param	ctx			Emulation context
  * @param	ccr_bits	CCR bit map (OR of M68_CCR_x constants)
  * @param	a			Accumulator initial value (or X-register for CPX)
  * @param	m			Operation parameter
  * @param	r			Operation result
+ * @return	The requested CCR bits which are set
  */
-static inline void update_flags(M68_CTX *ctx, const uint8_t ccr_bits, const uint8_t a, const uint8_t m, const uint8_t r, const M68_CARRY_TYPE carryMode)
+static inline uint8_t compute_flags(const uint8_t ccr_bits, const uint8_t a, const uint8_t m, const uint8_t r, const M68_CARRY_TYPE carryMode)
 {
+	uint8_t flags = 0;
+
 	// Half Carry
 	if (ccr_bits & M68_CCR_H) {
 		if (( (a & 0x08) &&  (m & 0x08)) ||
 				( (m & 0x08) && !(r & 0x08)) ||
 				(!(r & 0x08) &&  (a & 0x08))) {
-			ctx->reg_ccr |= M68_CCR_H;
-		} else {
-			ctx->reg_ccr &= ~M68_CCR_H;
+			flags |= M68_CCR_H;
 		}
 	}
 
 	// Negative
 	if (ccr_bits & M68_CCR_N) {
 		if (r & 0x80) {
-			ctx->reg_ccr |= M68_CCR_N;
-		} else {
-			ctx->reg_ccr &= ~M68_CCR_N;
+			flags |= M68_CCR_N;
 		}
 	}
 
 	// Zero
 	if (ccr_bits & M68_CCR_Z) {
 		if (r == 0) {
-			ctx->reg_ccr |= M68_CCR_Z;
-		} else {
-			ctx->reg_ccr &= ~M68_CCR_Z;
+			flags |= M68_CCR_Z;
 		}
 	}
 
@@ -103,15 +99,77 @@ static inline void update_flags(M68_CTX *ctx, const uint8_t ccr_bits, const uint
 
 			default:
 				assert(0);
+				newCarry = false;
 		}
 
 		if (newCarry) {
-			ctx->reg_ccr |= M68_CCR_C;
-		} else {
-			ctx->reg_ccr &= ~M68_CCR_C;
+			flags |= M68_CCR_C;
 		}
 	}
 
+	return flags;
+}
+
+/**
+ * Materialize the deferred CCR flag bits of one pending operation.
+ */
+static inline void sync_op(M68_CTX *ctx, M68_FLAG_OP *op, const uint8_t ccr_bits)
+{
+	uint8_t bits = op->bits & ccr_bits;
+
+	if (bits) {
+		ctx->reg_ccr = (ctx->reg_ccr & ~bits) | compute_flags(bits, op->a, op->m, op->r, op->carry);
+		op->bits &= ~bits;
+	}
+}
+
+/**
+ * Materialize deferred CCR flag bits into reg_ccr.
+ *
+ * With M68_LAZY_FLAGS, update_flags() only records the operands of the last
+ * flag-setting operations; the flags are computed here when something needs
+ * the real CCR value.
+ *
+ * @param	ctx			Emulation context
+ * @param	ccr_bits	Deferred bits to materialize
+ */
+static inline void sync_flags(M68_CTX *ctx, const uint8_t ccr_bits)
+{
+	sync_op(ctx, &ctx->lazy[0], ccr_bits);
+	sync_op(ctx, &ctx->lazy[1], ccr_bits);
+}
+
+/**
+ * Update the CCR flag bits after an arithmetic operation.
+ *
+ * @param	ctx			Emulation context
+ * @param	ccr_bits	CCR bit map (OR of M68_CCR_x constants)
+ * @param	a			Accumulator initial value (or X-register for CPX)
+ * @param	m			Operation parameter
+ * @param	r			Operation result
+ */
+static inline void update_flags(M68_CTX *ctx, const uint8_t ccr_bits, const uint8_t a, const uint8_t m, const uint8_t r, const M68_CARRY_TYPE carryMode)
+{
+#ifdef M68_LAZY_FLAGS
+	// Two operations stay pending: when the previous one still owns bits
+	// this one leaves alone (H and C after ADD, then LDA), it becomes the
+	// older record. Flags are only computed if that would drop a third.
+	ctx->lazy[1].bits &= ~ccr_bits;
+	ctx->lazy[0].bits &= ~ccr_bits;
+	if (ctx->lazy[0].bits) {
+		sync_op(ctx, &ctx->lazy[1], 0xFF);
+		ctx->lazy[1] = ctx->lazy[0];
+	}
+
+	ctx->lazy[0].bits = ccr_bits;
+	ctx->lazy[0].a = a;
+	ctx->lazy[0].m = m;
+	ctx->lazy[0].r = r;
+	ctx->lazy[0].carry = carryMode;
+#else
+	ctx->reg_ccr = (ctx->reg_ccr & ~ccr_bits) | compute_flags(ccr_bits, a, m, r, carryMode);
+#endif
+
 	// Force CCR top 3 bits to 1
 	ctx->reg_ccr |= 0xE0;
 }
@@ -125,6 +183,12 @@ static inline void update_flags(M68_CTX *ctx, const uint8_t ccr_bits, const uint
  */
 static inline void force_flags(M68_CTX *ctx, const uint8_t ccr_bits, const bool state)
 {
+#ifdef M68_LAZY_FLAGS
+	// Any deferred value for these bits is overwritten
+	ctx->lazy[0].bits &= ~ccr_bits;
+	ctx->lazy[1].bits &= ~ccr_bits;
+#endif
+
 	if (state) {
 		ctx->reg_ccr |= ccr_bits;
 	} else {
@@ -143,9 +207,40 @@ static inline void force_flags(M68_CTX *ctx, const uint8_t ccr_bits, const bool
  */
 static inline bool get_flag(M68_CTX *ctx, const uint8_t ccr_bit)
 {
+#ifdef M68_LAZY_FLAGS
+	const M68_FLAG_OP *op;
+
+	for (op = ctx->lazy; op < ctx->lazy + 2; op++) {
+		if (op->bits & ccr_bit) {
+			return compute_flags(ccr_bit, op->a, op->m, op->r, op->carry) != 0;
+		}
+	}
+#endif
 	return (ctx->reg_ccr & ccr_bit) ? true : false;
 }
 
+/**
+ * Read the condition code register.
+ *
+ * Embedders must use this rather than reading reg_ccr directly, which may
+ * be stale when the core is built with M68_LAZY_FLAGS.
+ */
+uint8_t m68_get_ccr(M68_CTX *ctx)
+{
+	sync_flags(ctx, 0xFF);
+	return ctx->reg_ccr;
+}
+
+/**
+ * Write the condition code register, discarding any deferred flags.
+ */
+void m68_set_ccr(M68_CTX *ctx, const uint8_t ccr)
+{
+	ctx->lazy[0].bits = 0;
+	ctx->lazy[1].bits = 0;
+	ctx->reg_ccr = ccr;
+}
+
 /**
  * Push a byte onto the stack
  *
@@ -154,7 +249,7 @@ static inline bool get_flag(M68_CTX *ctx, const uint8_t ccr_bit)
  */
 static inline void push_byte(M68_CTX *ctx, const uint8_t value)
 {
-	ctx->write_mem(ctx, ctx->reg_sp, value);
+	m68_write_byte(ctx, ctx->reg_sp, value);
 	ctx->reg_sp = ((ctx->reg_sp - 1) & ctx->sp_and) | ctx->sp_or;
 }
 
@@ -167,7 +262,54 @@ static inline void push_byte(M68_CTX *ctx, const uint8_t value)
 static inline uint8_t pop_byte(M68_CTX *ctx)
 {
 	ctx->reg_sp = ((ctx->reg_sp + 1) & ctx->sp_and) | ctx->sp_or;
-	return ctx->read_mem(ctx, ctx->reg_sp);
+	return m68_read_byte(ctx, ctx->reg_sp);
+}
+
+/**
+ * Stack the registers and jump through an interrupt vector.
+ *
+ * Used by SWI and for hardware interrupt entry. The return address is
+ * pc_next, so this must be called between instructions (or, for SWI, once
+ * the instruction has been fetched).
+ *
+ * @param	ctx			Emulation context
+ * @param	vector		Address of the vector
+ */
+void m68_enter_interrupt(M68_CTX *ctx, const uint16_t vector)
+{
+	push_byte(ctx, ctx->pc_next & 0xFF);
+	push_byte(ctx, ctx->pc_next >> 8);
+	push_byte(ctx, ctx->reg_x);
+	push_byte(ctx, ctx->reg_acc);
+	push_byte(ctx, m68_get_ccr(ctx));
+
+	// Mask further interrupts
+	force_flags(ctx, M68_CCR_I, 1);
+
+	// Vector fetch
+	uint16_t addr;
+	addr = (uint16_t)m68_read_byte(ctx, vector & ctx->pc_and) << 8;
+	addr |= m68_read_byte(ctx, (vector + 1) & ctx->pc_and);
+	ctx->pc_next = addr & ctx->pc_and;
+
+	// Any interrupt ends WAIT or STOP
+	if (ctx->is_stopped) {
+		m68_clock_resume(ctx);
+	}
+	ctx->is_waiting = false;
+}
+
+/**
+ * End the current run slice if an interrupt may now be taken.
+ *
+ * Called by instructions that clear the I bit, so m68_run() gets to check
+ * for interrupts before the next slice.
+ */
+static inline void irq_unmasked(M68_CTX *ctx)
+{
+	if (ctx->irq_pending) {
+		ctx->deadline = ctx->cycles;
+	}
 }
 
 
@@ -193,7 +335,7 @@ static inline uint8_t pop_byte(M68_CTX *ctx)
 /// ADC: Add with carry
 static bool m68op_ADC(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 {
-	uint16_t result = ctx->reg_acc + *param + (ctx->reg_ccr & M68_CCR_C ? 1 : 0);
+	uint16_t result = ctx->reg_acc + *param + (get_flag(ctx, M68_CCR_C) ? 1 : 0);
 
 	update_flags(ctx, M68_CCR_H | M68_CCR_N | M68_CCR_Z | M68_CCR_C, ctx->reg_acc, *param, result, CARRY_ADD);
 	ctx->reg_acc = result;
@@ -438,6 +580,7 @@ static bool m68op_CLC(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 static bool m68op_CLI(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 {
 	force_flags(ctx, M68_CCR_I, 0);
+	irq_unmasked(ctx);
 
 	// Inherent operation, nothing to write back
 	return false;
@@ -657,7 +800,7 @@ static bool m68op_RSP(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 static bool m68op_RTI(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 {
 	// pop CCR, ACCA, X
-	ctx->reg_ccr = pop_byte(ctx);
+	m68_set_ccr(ctx, pop_byte(ctx));
 	ctx->reg_acc = pop_byte(ctx);
 	ctx->reg_x   = pop_byte(ctx);
 
@@ -668,6 +811,10 @@ static bool m68op_RTI(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 	new_pc |= pop_byte(ctx);
 	ctx->pc_next = new_pc & ctx->pc_and;
 
+	if (!get_flag(ctx, M68_CCR_I)) {
+		irq_unmasked(ctx);
+	}
+
 	// Inherent operation, nothing to write back
 	return false;
 }
@@ -688,7 +835,7 @@ static bool m68op_RTS(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 /// SBC: Subtract with carry
 static bool m68op_SBC(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 {
-	uint16_t result = ctx->reg_acc - *param - (ctx->reg_ccr & M68_CCR_C ? 1 : 0);
+	uint16_t result = ctx->reg_acc - *param - (get_flag(ctx, M68_CCR_C) ? 1 : 0);
 
 	update_flags(ctx, M68_CCR_N | M68_CCR_Z | M68_CCR_C, ctx->reg_acc, *param, result, CARRY_SUB);
 	ctx->reg_acc = result;
@@ -730,6 +877,10 @@ static bool m68op_STOP(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 {
 	force_flags(ctx, M68_CCR_I, 0);
 	ctx->is_stopped = true;
+	ctx->stopped_since = ctx->cycles;
+
+	// Hand back to m68_run() to idle until an interrupt
+	ctx->deadline = ctx->cycles;
 
 	// Inherent operation, nothing to write back
 	return false;
@@ -760,22 +911,8 @@ static bool m68op_SUB(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 /// SWI: Software Interrupt
 static bool m68op_SWI(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 {
-	// TODO Lift this code for use by IRQ?
 	// PC will already have been advanced by the emulation loop
-	push_byte(ctx, ctx->pc_next & 0xFF);
-	push_byte(ctx, ctx->pc_next >> 8);
-	push_byte(ctx, ctx->reg_x);
-	push_byte(ctx, ctx->reg_acc);
-	push_byte(ctx, ctx->reg_ccr);
-
-	// Mask further interrupts
-	force_flags(ctx, M68_CCR_I, 1);
-
-	// Vector fetch
-	uint16_t vector;
-	vector = (uint16_t)ctx->read_mem(ctx, 0xFFFC & ctx->pc_and) << 8;
-	vector |= ctx->read_mem(ctx, 0xFFFD & ctx->pc_and);
-	ctx->pc_next = vector;
+	m68_enter_interrupt(ctx, _M68_SWI_VECTOR);
 
 	// Inherent operation, nothing to write back
 	return false;
@@ -814,6 +951,9 @@ static bool m68op_WAIT(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 	force_flags(ctx, M68_CCR_I, 0);
 	ctx->is_waiting = true;
 
+	// Hand back to m68_run() to idle until an interrupt
+	ctx->deadline = ctx->cycles;
+
 	// Inherent operation, nothing to write back
 	return false;
 }
@@ -825,3 +965,90 @@ static bool m68op_WAIT(M68_CTX *ctx, const uint8_t opcode, uint8_t *param)
 
 #include "m68_optab_hc05.h"
 
+/****************************************************************************
+ * SPECIALIZED OPCODE HANDLERS
+ ****************************************************************************/
+
+#include "m68_handlers_hc05.h"
+
+
+/****************************************************************************
+ * PREDECODED INSTRUCTION HANDLERS
+ ****************************************************************************/
+
+#include "m68_uops_hc05.h"
+
+
+/****************************************************************************
+ * THREADED-CODE INTERPRETER
+ ****************************************************************************/
+
+#ifdef M68_HAVE_COMPUTED_GOTO
+
+/**
+ * Run loop using threaded-code dispatch.
+ *
+ * Runs until ctx->deadline like the other engines, without opcode decode,
+ * breakpoint or trace support. Each opcode body jumps straight to the next opcode's
+ * body, giving the host branch predictor one indirect branch per opcode
+ * instead of a single shared dispatch site.
+ *
+ * All 256 bodies live in this one function, which is far past the size at
+ * which GCC stops inlining: without 'flatten' the memory accessors and the
+ * m68op_ functions become calls, and the engine runs at half the speed of
+ * the handler table on I/O-bound code.
+ */
+__attribute__((flatten)) M68_EXIT m68hc05_run_threaded(M68_CTX *ctx)
+{
+	M68_EXIT reason = M68_EXIT_BUDGET;
+
+// Fetch the next opcode and jump to its body
+#define THREADED_FETCH()											\
+	do {															\
+		ctx->reg_pc = ctx->pc_next;									\
+		goto *threaded_table[m68_read_byte(ctx, ctx->pc_next++)];	\
+	} while (0)
+
+// First instruction
+#define THREADED_START												\
+	do {															\
+		if (ctx->cycles >= ctx->deadline) {							\
+			goto out;												\
+		}															\
+		THREADED_FETCH();											\
+	} while (0)
+
+// Account for the finished instruction, check exit conditions, dispatch
+#define THREADED_NEXT(n)											\
+	do {															\
+		ctx->cycles += (n);											\
+		if (ctx->cycles >= ctx->deadline) {							\
+			goto out;												\
+		}															\
+		if (ctx->stop_request) {									\
+			ctx->stop_request = false;								\
+			reason = M68_EXIT_STOP_REQUEST;							\
+			goto out;												\
+		}															\
+		THREADED_FETCH();											\
+	} while (0)
+
+#define THREADED_ILLEGAL(opval)										\
+	do {															\
+		m68_illegal(ctx, (opval));									\
+		reason = M68_EXIT_ILLEGAL;									\
+		goto out;													\
+	} while (0)
+
+#include "m68_threaded_hc05.h"
+
+#undef THREADED_FETCH
+#undef THREADED_START
+#undef THREADED_NEXT
+#undef THREADED_ILLEGAL
+
+out:
+	return reason;
+}
+
+#endif // M68_HAVE_COMPUTED_GOTO
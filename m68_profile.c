@@ -0,0 +1,453 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "m68emu.h"
+#include "m68_internal.h"
+
+
+/// Deepest call chain tracked; deeper calls are charged to their caller
+#define MAX_DEPTH		64
+
+/// Initial calling-context tree size, in nodes
+#define INITIAL_NODES	256
+
+typedef struct M68_SYMBOL {
+	uint16_t		addr;
+	char *			name;
+} M68_SYMBOL;
+
+
+/**
+ * Fill in the control-flow change each opcode makes.
+ */
+static void classify_opcodes(M68_PROFILE *prof)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		const char *mnem = m68hc05_optable[i].mnem;
+
+		if (strcmp(mnem, "JSR") == 0 || strcmp(mnem, "BSR") == 0) {
+			prof->flow[i] = M68_PROF_CALL;
+		} else if (strcmp(mnem, "RTS") == 0) {
+			prof->flow[i] = M68_PROF_RETURN;
+		} else if (strcmp(mnem, "SWI") == 0) {
+			prof->flow[i] = M68_PROF_SWI;
+		} else if (strcmp(mnem, "RTI") == 0) {
+			prof->flow[i] = M68_PROF_RTI;
+		} else {
+			prof->flow[i] = M68_PROF_NONE;
+		}
+	}
+}
+
+/**
+ * Enable the profiler.
+ *
+ * Counts executions and cycles per PC, and follows JSR/BSR/RTS, SWI/RTI and
+ * interrupts to attribute cycles to routines by calling context. m68_run()
+ * uses the instrumented loops while it is enabled. Cycles spent idle in
+ * WAIT or STOP are not charged to any routine.
+ *
+ * @return	false if out of memory
+ */
+bool m68_profile_enable(M68_CTX *ctx)
+{
+	M68_PROFILE *prof;
+	size_t n = (size_t)ctx->pc_and + 1;
+
+	if (ctx->profile != NULL) {
+		return true;
+	}
+
+	prof = calloc(1, sizeof(M68_PROFILE));
+	if (prof == NULL) {
+		return false;
+	}
+	prof->count = calloc(n, sizeof(uint64_t));
+	prof->cycles = calloc(n, sizeof(uint64_t));
+	prof->owner = calloc(n, sizeof(uint16_t));
+	prof->nodes = malloc(INITIAL_NODES * sizeof(M68_PROF_NODE));
+	if (prof->count == NULL || prof->cycles == NULL || prof->owner == NULL || prof->nodes == NULL) {
+		free(prof->count);
+		free(prof->cycles);
+		free(prof->owner);
+		free(prof->nodes);
+		free(prof);
+		return false;
+	}
+	prof->size = INITIAL_NODES;
+	classify_opcodes(prof);
+
+	// The root stands for whatever is running now, usually the reset code
+	memset(&prof->nodes[0], 0, sizeof(M68_PROF_NODE));
+	prof->nodes[0].entry = ctx->pc_next;
+	prof->nodes[0].parent = -1;
+	prof->nodes[0].child = -1;
+	prof->nodes[0].sibling = -1;
+	prof->nodes[0].calls = 1;
+	prof->nnodes = 1;
+
+	ctx->profile = prof;
+	return true;
+}
+
+/**
+ * Release the profiler state.
+ */
+void m68_profile_free(M68_CTX *ctx)
+{
+	M68_PROFILE *prof = ctx->profile;
+	int i;
+
+	if (prof == NULL) {
+		return;
+	}
+	for (i = 0; i < prof->nsymbols; i++) {
+		free(prof->symbols[i].name);
+	}
+	free(prof->symbols);
+	free(prof->count);
+	free(prof->cycles);
+	free(prof->owner);
+	free(prof->nodes);
+	free(prof);
+	ctx->profile = NULL;
+}
+
+/**
+ * Enter a routine: move to (creating if needed) the child of the current
+ * node for 'entry'.
+ */
+static void push(M68_PROFILE *prof, const uint16_t entry, const uint16_t site, const bool interrupt)
+{
+	M68_PROF_NODE *cur = &prof->nodes[prof->current];
+	M68_PROF_NODE *node;
+	int i;
+
+	if (prof->lost > 0 || cur->depth >= MAX_DEPTH) {
+		prof->lost++;
+		return;
+	}
+
+	for (i = cur->child; i >= 0; i = prof->nodes[i].sibling) {
+		if (prof->nodes[i].entry == entry && prof->nodes[i].interrupt == interrupt) {
+			break;
+		}
+	}
+
+	if (i < 0) {
+		if (prof->nnodes == prof->size) {
+			M68_PROF_NODE *nodes = realloc(prof->nodes, 2 * prof->size * sizeof(M68_PROF_NODE));
+
+			if (nodes == NULL) {
+				prof->lost++;
+				return;
+			}
+			prof->nodes = nodes;
+			prof->size *= 2;
+			cur = &prof->nodes[prof->current];
+		}
+		i = prof->nnodes++;
+		node = &prof->nodes[i];
+		memset(node, 0, sizeof(M68_PROF_NODE));
+		node->entry = entry;
+		node->site = site;
+		node->interrupt = interrupt;
+		node->depth = cur->depth + 1;
+		node->parent = prof->current;
+		node->child = -1;
+		node->sibling = cur->child;
+		cur->child = i;
+	}
+
+	prof->nodes[i].calls++;
+	prof->current = i;
+}
+
+/**
+ * Apply the control-flow change made by the instruction just executed.
+ */
+void m68_profile_update(M68_CTX *ctx, const M68_PROF_OP op)
+{
+	M68_PROFILE *prof = ctx->profile;
+	M68_PROF_NODE *cur;
+
+	switch (op) {
+		case M68_PROF_CALL:
+			push(prof, ctx->pc_next, ctx->reg_pc, false);
+			break;
+
+		case M68_PROF_SWI:
+			push(prof, ctx->pc_next, ctx->reg_pc, true);
+			break;
+
+		case M68_PROF_RETURN:
+			cur = &prof->nodes[prof->current];
+			if (prof->lost > 0) {
+				prof->lost--;
+			} else if (cur->parent >= 0 && !cur->interrupt) {
+				prof->current = cur->parent;
+			}
+			break;
+
+		case M68_PROF_RTI:
+			// Unwind to the caller of the innermost interrupt, dropping any
+			// frames the handler left behind
+			prof->lost = 0;
+			while (prof->current > 0) {
+				cur = &prof->nodes[prof->current];
+				prof->current = cur->parent;
+				if (cur->interrupt) {
+					break;
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**
+ * Enter a hardware interrupt handler (ctx->pc_next) taken at 'site'.
+ */
+void m68_profile_interrupt(M68_CTX *ctx, const uint16_t site)
+{
+	M68_PROFILE *prof = ctx->profile;
+
+	push(prof, ctx->pc_next, site, true);
+	prof->nodes[prof->current].cycles += M68_INT_CYCLES;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+	const M68_SYMBOL *x = a, *y = b;
+
+	return (int)x->addr - (int)y->addr;
+}
+
+/**
+ * Load routine names for the profile.
+ *
+ * Each line holds a hex address, an optional type and a name, e.g. the
+ * output of nm ("0100 T main") or a plain "0x0100 main". Lines that do not
+ * parse are ignored.
+ *
+ * @return	Number of symbols loaded, or -1 if the file cannot be read
+ */
+int m68_profile_symbols(M68_CTX *ctx, const char *filename)
+{
+	M68_PROFILE *prof = ctx->profile;
+	char line[256];
+	FILE *f;
+
+	if (prof == NULL) {
+		return -1;
+	}
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char addr[64], a[128], b[128];
+		char *end, *name;
+		unsigned long value;
+		int n;
+
+		n = sscanf(line, "%63s %127s %127s", addr, a, b);
+		if (n < 2) {
+			continue;
+		}
+		value = strtoul(addr, &end, 16);
+		if (*end != '\0' || value > 0xFFFF) {
+			continue;
+		}
+		name = (n == 3) ? b : a;
+
+		M68_SYMBOL *symbols = realloc(prof->symbols, (prof->nsymbols + 1) * sizeof(M68_SYMBOL));
+		if (symbols == NULL) {
+			break;
+		}
+		prof->symbols = symbols;
+		prof->symbols[prof->nsymbols].addr = value;
+		prof->symbols[prof->nsymbols].name = strdup(name);
+		if (prof->symbols[prof->nsymbols].name == NULL) {
+			break;
+		}
+		prof->nsymbols++;
+	}
+	fclose(f);
+
+	qsort(prof->symbols, prof->nsymbols, sizeof(M68_SYMBOL), compare_symbols);
+	return prof->nsymbols;
+}
+
+/**
+ * Find the symbol covering 'addr': the last one at or below it.
+ */
+static const M68_SYMBOL *find_symbol(const M68_PROFILE *prof, const uint16_t addr)
+{
+	int lo = 0, hi = prof->nsymbols - 1;
+	const M68_SYMBOL *found = NULL;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (prof->symbols[mid].addr <= addr) {
+			found = &prof->symbols[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+/**
+ * Name the routine containing 'addr': its symbol if there is one, else
+ * "sub_" and the routine's entry address 'entry'.
+ */
+static const char *routine_name(const M68_PROFILE *prof, const uint16_t addr, const uint16_t entry,
+	char *buf, size_t size)
+{
+	const M68_SYMBOL *sym = find_symbol(prof, addr);
+
+	if (sym != NULL) {
+		return sym->name;
+	}
+	snprintf(buf, size, "sub_%04X", entry);
+	return buf;
+}
+
+/**
+ * Compute inclusive costs: children are always created after their
+ * parent, so one backwards pass adds each node into its parent.
+ */
+static bool inclusive_costs(const M68_PROFILE *prof, uint64_t **cycles, uint64_t **insns)
+{
+	int i;
+
+	*cycles = malloc(prof->nnodes * sizeof(uint64_t));
+	*insns = malloc(prof->nnodes * sizeof(uint64_t));
+	if (*cycles == NULL || *insns == NULL) {
+		free(*cycles);
+		free(*insns);
+		return false;
+	}
+	for (i = 0; i < prof->nnodes; i++) {
+		(*cycles)[i] = prof->nodes[i].cycles;
+		(*insns)[i] = prof->nodes[i].insns;
+	}
+	for (i = prof->nnodes - 1; i > 0; i--) {
+		(*cycles)[prof->nodes[i].parent] += (*cycles)[i];
+		(*insns)[prof->nodes[i].parent] += (*insns)[i];
+	}
+	return true;
+}
+
+/**
+ * Write the profile in callgrind format, for KCachegrind and friends.
+ *
+ * @param	ctx		Emulation context
+ * @param	f		Output file
+ * @param	cmd		Command line to record in the profile, or NULL
+ * @return	0 on success, -1 if the profiler is off or out of memory
+ */
+int m68_profile_callgrind(M68_CTX *ctx, FILE *f, const char *cmd)
+{
+	const M68_PROFILE *prof = ctx->profile;
+	uint64_t *incl_cycles, *incl_insns;
+	uint64_t total_cycles = 0, total_insns = 0;
+	char buf[16], fn[128] = "";
+	uint32_t pc;
+	int i;
+
+	if (prof == NULL || !inclusive_costs(prof, &incl_cycles, &incl_insns)) {
+		return -1;
+	}
+	for (pc = 0; pc <= ctx->pc_and; pc++) {
+		total_cycles += prof->cycles[pc];
+		total_insns += prof->count[pc];
+	}
+
+	fprintf(f, "# callgrind format\n");
+	fprintf(f, "version: 1\n");
+	fprintf(f, "creator: m68emu\n");
+	if (cmd != NULL) {
+		fprintf(f, "cmd: %s\n", cmd);
+	}
+	fprintf(f, "positions: instr\n");
+	fprintf(f, "events: Cycles Instructions\n");
+	fprintf(f, "summary: %llu %llu\n\n", (unsigned long long)total_cycles, (unsigned long long)total_insns);
+
+	// Self cost per instruction; a repeated fn= line adds to that routine
+	for (pc = 0; pc <= ctx->pc_and; pc++) {
+		const char *name;
+
+		if (prof->count[pc] == 0) {
+			continue;
+		}
+		name = routine_name(prof, pc, prof->owner[pc], buf, sizeof(buf));
+		if (strcmp(name, fn) != 0) {
+			fprintf(f, "fn=%s\n", name);
+			snprintf(fn, sizeof(fn), "%s", name);
+		}
+		fprintf(f, "0x%04X %llu %llu\n", pc,
+			(unsigned long long)prof->cycles[pc], (unsigned long long)prof->count[pc]);
+	}
+
+	// One call arc per calling-context node
+	for (i = 1; i < prof->nnodes; i++) {
+		const M68_PROF_NODE *node = &prof->nodes[i];
+		const M68_PROF_NODE *parent = &prof->nodes[node->parent];
+
+		fprintf(f, "\nfn=%s\n", routine_name(prof, node->site, parent->entry, buf, sizeof(buf)));
+		fprintf(f, "cfn=%s\n", routine_name(prof, node->entry, node->entry, buf, sizeof(buf)));
+		fprintf(f, "calls=%llu 0x%04X\n", (unsigned long long)node->calls, node->entry);
+		fprintf(f, "0x%04X %llu %llu\n", node->site,
+			(unsigned long long)incl_cycles[i], (unsigned long long)incl_insns[i]);
+	}
+
+	free(incl_cycles);
+	free(incl_insns);
+	return 0;
+}
+
+/**
+ * Write the profile as folded stacks ("main;sub_0200;sub_0300 1234", self
+ * cycles per calling context) for flame graph tools.
+ *
+ * @return	0 on success, -1 if the profiler is off
+ */
+int m68_profile_folded(M68_CTX *ctx, FILE *f)
+{
+	const M68_PROFILE *prof = ctx->profile;
+	int path[MAX_DEPTH + 1];
+	char buf[16];
+	int i, j, depth;
+
+	if (prof == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < prof->nnodes; i++) {
+		if (prof->nodes[i].cycles == 0) {
+			continue;
+		}
+		depth = 0;
+		for (j = i; j >= 0; j = prof->nodes[j].parent) {
+			path[depth++] = j;
+		}
+		while (depth-- > 0) {
+			const M68_PROF_NODE *node = &prof->nodes[path[depth]];
+
+			fprintf(f, "%s%s%s", routine_name(prof, node->entry, node->entry, buf, sizeof(buf)),
+				node->interrupt ? "_[i]" : "", depth ? ";" : "");
+		}
+		fprintf(f, " %llu\n", (unsigned long long)prof->nodes[i].cycles);
+	}
+	return 0;
+}
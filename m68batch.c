@@ -0,0 +1,669 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>	/* getopt() */
+#include <pthread.h>
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* sysconf() */
+
+#include "board.h"
+#include "image.h"
+
+/*
+ * Headless batch runner.
+ *
+ * Each manifest line describes one job:
+ *
+ *	image stimulus cycles expected
+ *
+ * 'image' is a board image (see srec2img) or an S-record, Intel HEX or
+ * raw binary file, 'stimulus' a file whose bytes are fed to the UART
+ * receiver, 'cycles' the number of CPU cycles to run and 'expected' a file
+ * holding the exact UART/ACIA output the job must produce. Use '-' for no
+ * stimulus or no expected output. Blank lines and lines starting with '#'
+ * are ignored.
+ *
+ * Jobs run on a pool of worker threads, each with its own board. Every
+ * job is a pure function of its inputs: stimulus bytes are delivered at
+ * fixed cycle boundaries, never in response to host timing. Results are
+ * printed in manifest order once all jobs have finished, so the output is
+ * the same whatever the thread count.
+ *
+ * With -p, each job is profiled and writes <prefix>.<line>.callgrind and
+ * <prefix>.<line>.folded, named after its manifest line.
+ *
+ * Jobs running the same image share its ROM pages; each board has private
+ * copies of only its RAM and I/O pages. -w chooses what a write to ROM
+ * does: copy the page into the board (the default), ignore the write, or
+ * trap, failing the job.
+ *
+ * -M gives every job a memory map (see memmap_load_file()) in place of
+ * memory repeating through the address space.
+ *
+ * With -l, each job also runs on the reference interpreter in lockstep
+ * with the selected engine, and fails at the first sync point where the
+ * two disagree, printing both states.
+ */
+
+typedef enum {
+	JOB_DONE,		///< Ran to the cycle limit, nothing to compare against
+	JOB_PASS,		///< Output matched
+	JOB_FAIL,		///< Output differed
+	JOB_ERROR		///< Could not run
+} JOB_STATUS;
+
+static const char *status_names[] = { "DONE", "PASS", "FAIL", "ERROR" };
+
+typedef struct BUF {
+	uint8_t *		data;
+	size_t			len;
+	size_t			size;
+} BUF;
+
+typedef struct JOB {
+	int				line;					///< Manifest line number
+	char *			image;					///< Image file
+	char *			stimulus;				///< UART input file, or NULL
+	char *			expected;				///< Expected output file, or NULL
+	uint64_t		cycles;					///< Cycle limit
+	JOB_STATUS		status;					///< Result
+	const char *	error;					///< Reason for JOB_ERROR, or note for a failure
+	uint64_t		ran;					///< Cycles actually run
+	uint64_t		skipped;				///< Cycles fast-forwarded in polling loops
+	size_t			footprint;				///< Bytes of memory private to the job's board at the end
+	BOARD_CONFIG	config;					///< Board layout
+	BOARD_ROM *		rom;					///< Firmware, shared with other jobs running the same image
+	const char *	load_error;				///< Why the firmware could not be loaded, if rom is NULL
+	BUF				output;					///< Bytes transmitted by the firmware
+	char *			diff;					///< State of both boards at a lockstep divergence, or NULL
+} JOB;
+
+/*
+ * Per-worker job deque. The owner takes work from the tail, thieves take
+ * it from the head, so a thief gets the work the owner would have reached
+ * last.
+ */
+typedef struct WORKER {
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	int *			jobs;					///< Job indices, live in [head, tail)
+	int				head, tail;
+	int				id;
+} WORKER;
+
+JOB *jobs;
+int njobs;
+WORKER *workers;
+int nworkers;
+
+unsigned int memsize = 0x2000;
+uint32_t quantum = 3500;	/* cycles between stimulus bytes, ~1ms */
+M68_ENGINE engine = M68_ENGINE_BLOCK;
+int verbose = 0;
+const char *profile = NULL;	/* profile output prefix, or NULL */
+BOARD_ROM_POLICY rom_policy = BOARD_ROM_COPY;
+uint32_t lockstep = 0;		/* cycles between lockstep comparisons, 0 for none */
+MEMMAP *memmap = NULL;		/* memory map for every job, or NULL */
+
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+buf_append(BUF *buf, const uint8_t *data, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		size_t size = buf->size ? buf->size : 256;
+		uint8_t *p;
+
+		while (size < buf->len + len)
+			size *= 2;
+		p = realloc(buf->data, size);
+		if (p == NULL)
+			return -1;
+		buf->data = p;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+int
+read_file(const char *filename, BUF *buf)
+{
+	uint8_t chunk[4096];
+	size_t n;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return -1;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		if (buf_append(buf, chunk, n) < 0) {
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+void
+job_tx(void *user, uint8_t data)
+{
+	JOB *job = user;
+
+	buf_append(&job->output, &data, 1);
+}
+
+void
+buf_tx(void *user, uint8_t data)
+{
+	BUF *buf = user;
+
+	buf_append(buf, &data, 1);
+}
+
+/*
+ * Load the firmware for every job. Jobs running the same image share one
+ * copy of it. The memory map is checked against each image's memory
+ * size, and a map that does not fit fails the job as a load error.
+ */
+void
+load_firmware(void)
+{
+	MEMMAP_PAGE table[M68_PAGE_COUNT];
+	int i, j;
+
+	for (i = 0; i < njobs; i++) {
+		JOB *job = &jobs[i];
+		LOADER ld;
+
+		for (j = 0; j < i; j++)
+			if (strcmp(jobs[j].image, job->image) == 0)
+				break;
+		if (j < i) {
+			job->config = jobs[j].config;
+			job->rom = jobs[j].rom ? board_rom_ref(jobs[j].rom) : NULL;
+			job->load_error = jobs[j].load_error;
+			continue;
+		}
+
+		if (image_probe(job->image)) {
+			job->rom = image_open(job->image, &job->config, &job->load_error);
+		} else {
+			board_default_config(&job->config, memsize);
+			job->rom = board_rom_new(memsize);
+			if (job->rom == NULL) {
+				job->load_error = "out of memory";
+			} else if (board_rom_load(job->rom, job->image, 0, &ld) < 0) {
+				job->load_error = ld.error;
+				board_rom_unref(job->rom);
+				job->rom = NULL;
+			}
+		}
+
+		if (job->rom != NULL && memmap != NULL) {
+			if (memmap_compile(memmap, job->config.memsize, table, &job->load_error) < 0) {
+				board_rom_unref(job->rom);
+				job->rom = NULL;
+			}
+			job->config.map = memmap;
+		}
+	}
+}
+
+/*
+ * Create a board running 'job' on 'engine'.
+ *
+ * @return	NULL on success, otherwise the reason for failure
+ */
+const char *
+new_board(JOB *job, M68_ENGINE engine, void (*on_tx)(void *, uint8_t), void *user, BOARD **boardp)
+{
+	BOARD *board;
+
+	if (job->rom == NULL)
+		return job->load_error;
+	*boardp = board = board_new_config(&job->config, job->rom, on_tx, user);
+	if (board == NULL)
+		return "out of memory";
+
+	board->ctx.engine = engine;
+	board->rom_policy = rom_policy;
+	board_map_memory(board);
+	m68_reset(&board->ctx);
+	return NULL;
+}
+
+/*
+ * Run a job on the selected engine, feeding it a stimulus byte every
+ * quantum.
+ */
+void
+run_single(JOB *job, BOARD *board, const BUF *stimulus)
+{
+	size_t pos = 0;
+	uint32_t used;
+	M68_EXIT reason;
+
+	while (job->ran < job->cycles) {
+		uint64_t left = job->cycles - job->ran;
+
+		reason = m68_run(&board->ctx, left < quantum ? left : quantum, &used);
+		job->ran += used;
+		if (reason == M68_EXIT_ILLEGAL) {
+			job->error = "illegal instruction";
+			break;
+		}
+		if (board->rom_trapped) {
+			job->error = "write to ROM";
+			break;
+		}
+		if (pos < stimulus->len && !uart_rx_full(board->uart))
+			uart_rx(board->uart, stimulus->data[pos++]);
+	}
+}
+
+/*
+ * Run a job on the selected engine with the reference interpreter in
+ * lockstep, comparing the two boards and their output every 'lockstep'
+ * cycles.
+ *
+ * The engine runs first and the reference catches up to its cycle count,
+ * so sync points fall wherever the engine stops: with -l 1 that is every
+ * instruction, or every block on the block engine, which never stops
+ * inside one. Stimulus bytes go to both boards at the same cycle counts.
+ */
+void
+run_lockstep(JOB *job, BOARD *board, BOARD *ref, const BUF *stimulus, const BUF *ref_output)
+{
+	char diff[2048];
+	uint64_t feed = quantum;
+	size_t pos = 0;
+	uint32_t used;
+	M68_EXIT reason, ref_reason;
+
+	while (job->ran < job->cycles) {
+		uint64_t left = job->cycles - job->ran;
+		uint64_t from = board->ctx.cycles;
+		uint16_t pc = board->ctx.pc_next;
+		int differ;
+
+		reason = m68_run(&board->ctx, left < lockstep ? left : lockstep, &used);
+		job->ran += used;
+		ref_reason = M68_EXIT_BUDGET;
+		while (ref->ctx.cycles < board->ctx.cycles && ref_reason != M68_EXIT_ILLEGAL)
+			ref_reason = m68_run(&ref->ctx, board->ctx.cycles - ref->ctx.cycles, NULL);
+		// An illegal opcode takes no cycles; step the reference onto it too
+		if (reason == M68_EXIT_ILLEGAL && ref_reason != M68_EXIT_ILLEGAL)
+			m68_run(&ref->ctx, 1, NULL);
+
+		differ = board_compare(ref, board, diff, sizeof(diff));
+		if (!differ && (ref_output->len != job->output.len || (job->output.len != 0 &&
+		    memcmp(ref_output->data, job->output.data, job->output.len) != 0))) {
+			snprintf(diff, sizeof(diff), "\toutput differs: %zu bytes from %s, %zu from %s\n",
+				ref_output->len, m68_engine_name(ref->ctx.engine),
+				job->output.len, m68_engine_name(board->ctx.engine));
+			differ = 1;
+		}
+		if (differ) {
+			size_t len = strlen(diff) + 64;
+
+			job->error = "diverged";
+			job->diff = malloc(len);
+			if (job->diff)
+				snprintf(job->diff, len, "\tstep from PC %04X at cycle %llu\n%s",
+					pc, (unsigned long long)from, diff);
+			break;
+		}
+
+		if (reason == M68_EXIT_ILLEGAL) {
+			job->error = "illegal instruction";
+			break;
+		}
+		if (board->rom_trapped) {
+			job->error = "write to ROM";
+			break;
+		}
+		if (board->ctx.cycles >= feed) {
+			feed = board->ctx.cycles + quantum;
+			if (pos < stimulus->len && !uart_rx_full(board->uart) && !uart_rx_full(ref->uart)) {
+				uart_rx(board->uart, stimulus->data[pos]);
+				uart_rx(ref->uart, stimulus->data[pos++]);
+			}
+		}
+	}
+}
+
+void
+run_job(JOB *job)
+{
+	BOARD *board = NULL, *ref = NULL;
+	BUF stimulus = { NULL, 0, 0 };
+	BUF expected = { NULL, 0, 0 };
+	BUF ref_output = { NULL, 0, 0 };
+	const char *error;
+
+	error = new_board(job, engine, job_tx, job, &board);
+	if (error == NULL && lockstep)
+		error = new_board(job, M68_ENGINE_INTERP, buf_tx, &ref_output, &ref);
+	if (error) {
+		job->status = JOB_ERROR;
+		job->error = error;
+		goto out;
+	}
+	if (job->stimulus && read_file(job->stimulus, &stimulus) < 0) {
+		job->status = JOB_ERROR;
+		job->error = "cannot read stimulus";
+		goto out;
+	}
+	if (job->expected && read_file(job->expected, &expected) < 0) {
+		job->status = JOB_ERROR;
+		job->error = "cannot read expected output";
+		goto out;
+	}
+	if (profile && !m68_profile_enable(&board->ctx)) {
+		job->status = JOB_ERROR;
+		job->error = "cannot allocate profiler";
+		goto out;
+	}
+
+	if (ref)
+		run_lockstep(job, board, ref, &stimulus, &ref_output);
+	else
+		run_single(job, board, &stimulus);
+
+	job->skipped = board->ctx.poll_skipped_cycles;
+	job->footprint = board_footprint(board);
+	if (profile) {
+		char prefix[1024];
+
+		snprintf(prefix, sizeof(prefix), "%s.%d", profile, job->line);
+		if (board_write_profile(board, prefix, job->image) < 0 && job->error == NULL)
+			job->error = "cannot write profile";
+	}
+
+	/* a job that stopped on an error fails whatever it printed */
+	if (job->error)
+		job->status = JOB_FAIL;
+	else if (job->expected == NULL)
+		job->status = JOB_DONE;
+	else if (job->output.len == expected.len &&
+	    memcmp(job->output.data, expected.data, expected.len) == 0)
+		job->status = JOB_PASS;
+	else
+		job->status = JOB_FAIL;
+
+out:
+	free(stimulus.data);
+	free(expected.data);
+	free(ref_output.data);
+	board_destroy(board);
+	board_destroy(ref);
+}
+
+/*
+ * Take the next job for worker 'w': its own newest job if it has one,
+ * otherwise the oldest job of the first other worker that has any.
+ *
+ * @return	Job index, or -1 when every deque is empty
+ */
+int
+take_job(WORKER *w)
+{
+	int i, job = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail > w->head)
+		job = w->jobs[--w->tail];
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 1; job < 0 && i < nworkers; i++) {
+		WORKER *victim = &workers[(w->id + i) % nworkers];
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->tail > victim->head)
+			job = victim->jobs[victim->head++];
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return job;
+}
+
+void *
+worker_main(void *arg)
+{
+	WORKER *w = arg;
+	int job;
+
+	/* jobs never spawn jobs, so once every deque is empty we are done */
+	while ((job = take_job(w)) >= 0)
+		run_job(&jobs[job]);
+	return NULL;
+}
+
+char *
+next_field(char **p)
+{
+	char *field = strtok_r(NULL, " \t\r\n", p);
+
+	if (field == NULL || strcmp(field, "-") == 0)
+		return NULL;
+	return strdup(field);
+}
+
+int
+parse_manifest(const char *filename)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: cannot open manifest %s\n", filename);
+		return -1;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		char *p, *image, *cycles, *end;
+		JOB *job;
+
+		lineno++;
+		image = strtok_r(line, " \t\r\n", &p);
+		if (image == NULL || image[0] == '#')
+			continue;
+
+		job = realloc(jobs, (njobs + 1) * sizeof(JOB));
+		if (job == NULL) {
+			fprintf(stderr, "ERROR: out of memory\n");
+			free(line);
+			fclose(f);
+			return -1;
+		}
+		jobs = job;
+		job = &jobs[njobs++];
+		memset(job, 0, sizeof(*job));
+		job->line = lineno;
+		job->image = strdup(image);
+		job->stimulus = next_field(&p);
+		cycles = strtok_r(NULL, " \t\r\n", &p);
+		job->expected = next_field(&p);
+		if (cycles == NULL || (job->cycles = strtoull(cycles, &end, 0), *end != '\0')) {
+			fprintf(stderr, "ERROR: %s:%d: expected 'image stimulus cycles expected'\n", filename, lineno);
+			free(line);
+			fclose(f);
+			return -1;
+		}
+	}
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+void
+print_output(const BUF *buf)
+{
+	size_t i;
+
+	printf("\toutput: \"");
+	for (i = 0; i < buf->len; i++) {
+		uint8_t ch = buf->data[i];
+
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch >= 0x20 && ch < 0x7f)
+			putchar(ch);
+		else
+			printf("\\x%02x", ch);
+	}
+	printf("\"\n");
+}
+
+void
+usage()
+{
+	printf("Usage: m68batch [-v] [-j threads] [-e engine] [-m memsize] [-q quantum] [-p profile] [-l step] [-M mapfile] [-w copy|ignore|trap] <manifest>\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t total = 0, skipped = 0;
+	size_t footprint = 0;
+	int counts[JOB_ERROR + 1] = { 0 };
+	double start, secs;
+	int i, opt;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "he:j:l:m:M:p:q:vw:")) != -1) {
+		switch (opt) {
+		case 'e':
+			for (engine = 0; engine < M68_ENGINE_MAX; engine++)
+				if (strcmp(optarg, m68_engine_name(engine)) == 0)
+					break;
+			if (engine == M68_ENGINE_MAX) {
+				fprintf(stderr, "ERROR: unknown engine %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			break;
+		case 'l':
+			lockstep = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			memsize = strtoul(optarg, NULL, 16);
+			break;
+		case 'M':
+			memmap = malloc(sizeof(MEMMAP));
+			memmap_init(memmap);
+			if (memmap_load_file(memmap, optarg) < 0) {
+				if (memmap->line)
+					fprintf(stderr, "ERROR: %s:%u: %s\n", optarg, memmap->line, memmap->error);
+				else
+					fprintf(stderr, "ERROR: %s: %s\n", optarg, memmap->error);
+				return 1;
+			}
+			break;
+		case 'p':
+			profile = optarg;
+			break;
+		case 'q':
+			quantum = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			for (rom_policy = 0; rom_policy < BOARD_ROM_POLICY_MAX; rom_policy++)
+				if (strcmp(optarg, board_rom_policy_name(rom_policy)) == 0)
+					break;
+			if (rom_policy == BOARD_ROM_POLICY_MAX) {
+				fprintf(stderr, "ERROR: unknown ROM write policy %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc || quantum == 0 || memsize == 0) {
+		usage();
+		return 1;
+	}
+
+	if (parse_manifest(argv[optind]) < 0)
+		return 1;
+	load_firmware();
+
+	if (nworkers > njobs)
+		nworkers = njobs;
+	if (nworkers < 1)
+		nworkers = 1;
+
+	/* deal the jobs out round-robin; stealing evens out the rest */
+	workers = calloc(nworkers, sizeof(WORKER));
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i;
+		workers[i].jobs = calloc(njobs / nworkers + 1, sizeof(int));
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	for (i = 0; i < njobs; i++) {
+		WORKER *w = &workers[i % nworkers];
+
+		w->jobs[w->tail++] = i;
+	}
+
+	start = now();
+	for (i = 0; i < nworkers; i++)
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	secs = now() - start;
+
+	for (i = 0; i < njobs; i++) {
+		JOB *job = &jobs[i];
+
+		printf("%-5s %s %s %llu", status_names[job->status], job->image,
+			job->stimulus ? job->stimulus : "-", (unsigned long long)job->ran);
+		if (job->error)
+			printf(" (%s)", job->error);
+		printf("\n");
+		if (job->diff)
+			printf("%s", job->diff);
+		if (verbose && job->status == JOB_FAIL)
+			print_output(&job->output);
+		counts[job->status]++;
+		total += job->ran;
+		skipped += job->skipped;
+		footprint += job->footprint;
+		board_rom_unref(job->rom);
+	}
+
+	fprintf(stderr, "%d jobs: %d passed, %d failed, %d errors, %d unchecked\n",
+		njobs, counts[JOB_PASS], counts[JOB_FAIL], counts[JOB_ERROR], counts[JOB_DONE]);
+	fprintf(stderr, "%llu cycles in %.3fs on %d threads: %.1f MHz\n",
+		(unsigned long long)total, secs, nworkers, secs > 0 ? total / secs / 1e6 : 0);
+	fprintf(stderr, "%llu cycles (%.1f%%) fast-forwarded in polling loops\n",
+		(unsigned long long)skipped, total ? 100.0 * skipped / total : 0);
+	fprintf(stderr, "%.0f bytes of private memory per board\n", njobs ? (double)footprint / njobs : 0);
+
+	return (counts[JOB_FAIL] || counts[JOB_ERROR]) ? 1 : 0;
+}
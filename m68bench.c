@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>	/* getopt() */
+#include <math.h>	/* sqrt() */
+#include <time.h>	/* clock_gettime() */
+
+#include "m68emu.h"
+#include "board.h"
+#include "loader.h"
+
+
+#define MEMSIZE	0x2000
+
+/* image size for the loader benchmark */
+#define LOAD_SIZE	(1024 * 1024)
+
+/* largest slowdown against the baseline that is not reported as a regression, in percent */
+#define DEFAULT_THRESHOLD	10.0
+
+/* directory holding the workload images, see bench/README.md */
+#define DEFAULT_WORKLOAD_DIR	"bench"
+
+uint8_t memspace[MEMSIZE];
+
+const char *workload_dir = DEFAULT_WORKLOAD_DIR;
+
+/*
+ * Workloads. Each is an S-record image in the workload directory, with its
+ * code at 0x0100 and a reset vector pointing there, and runs forever.
+ */
+typedef struct WORKLOAD {
+	const char *	name;		///< Also the image file name, less ".s19"
+	bool			board;		///< Run on the board with its peripherals, not flat memory
+} WORKLOAD;
+
+static const WORKLOAD workloads[] = {
+	{ "alu",	false },
+	{ "bits",	false },
+	{ "calls",	false },
+	{ "copy",	false },
+	{ "uart",	true },
+	{ "delay",	true },
+};
+#define NWORKLOADS (int)(sizeof(workloads)/sizeof(workloads[0]))
+
+typedef struct RESULT {
+	const char *	workload;
+	const char *	engine;
+	double			mips;		///< Mean emulated instructions per second, millions
+	double			mips_sd;	///< Standard deviation of mips over the repeats
+	double			mhz;		///< Mean emulated cycles per second, millions
+	double			ns;			///< Host nanoseconds per emulated instruction
+} RESULT;
+
+/*
+ * A workload ready to run: a flat-memory context, or a board.
+ */
+typedef struct BENCH {
+	M68_CTX			flat;
+	BOARD *			board;
+	M68_CTX *		ctx;
+} BENCH;
+
+uint8_t
+readfunc(struct M68_CTX *ctx, const uint16_t addr)
+{
+	return memspace[addr % MEMSIZE];
+}
+
+void
+writefunc(struct M68_CTX *ctx, const uint16_t addr, const uint8_t data)
+{
+	memspace[addr % MEMSIZE] = data;
+}
+
+void
+discard(void *user, uint8_t data)
+{
+}
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+setup(BENCH *bench, const WORKLOAD *w, M68_ENGINE engine)
+{
+	char filename[1024];
+	LOADER ld;
+
+	snprintf(filename, sizeof(filename), "%s/%s.s19", workload_dir, w->name);
+
+	if (w->board) {
+		BOARD_CONFIG config;
+		BOARD_ROM *rom = board_rom_new(MEMSIZE);
+
+		if (rom == NULL)
+			return -1;
+		if (board_rom_load(rom, filename, 0, &ld) < 0) {
+			fprintf(stderr, "ERROR: %s: %s\n", filename, ld.error);
+			board_rom_unref(rom);
+			return -1;
+		}
+
+		board_default_config(&config, MEMSIZE);
+		bench->board = board_new_config(&config, rom, discard, NULL);
+		board_rom_unref(rom);
+		if (bench->board == NULL)
+			return -1;
+		bench->ctx = &bench->board->ctx;
+	} else {
+		M68_CTX *ctx = &bench->flat;
+
+		memset(memspace, 0, sizeof(memspace));
+		loader_init(&ld, memspace, MEMSIZE);
+		if (loader_load_file(&ld, filename, LOADER_SREC) < 0) {
+			fprintf(stderr, "ERROR: %s: %s\n", filename, ld.error);
+			return -1;
+		}
+
+		memset(ctx, 0, sizeof(*ctx));
+		ctx->read_mem = &readfunc;
+		ctx->write_mem = &writefunc;
+		ctx->opdecode = NULL;
+		m68_init(ctx, M68_CPU_HC05C4);
+		bench->board = NULL;
+		bench->ctx = ctx;
+	}
+
+	if (bench->board)
+		board_map_memory(bench->board);
+	else
+		m68_map_pages(bench->ctx, 0, MEMSIZE, memspace, M68_MAP_READ | M68_MAP_WRITE);
+	bench->ctx->engine = engine;
+	m68_reset(bench->ctx);
+	return 0;
+}
+
+void
+teardown(BENCH *bench)
+{
+	if (bench->board)
+		board_destroy(bench->board);
+	else
+		m68_free(bench->ctx);
+}
+
+/*
+ * Count the instructions the reference interpreter executes in 'cycles'
+ * cycles. Every engine executes the same instruction stream, so this
+ * gives the instruction rate for all of them.
+ */
+uint64_t
+count_insns(const WORKLOAD *w, uint64_t cycles)
+{
+	BENCH bench;
+	uint64_t done = 0, insns = 0;
+
+	if (setup(&bench, w, M68_ENGINE_INTERP) < 0)
+		return 0;
+	while (done < cycles) {
+		done += m68_exec_cycle(bench.ctx);
+		insns++;
+	}
+	teardown(&bench);
+	return insns;
+}
+
+/*
+ * Run 'cycles' cycles of a workload on an engine.
+ *
+ * @return	Host seconds taken, or a negative value on failure
+ */
+double
+run_engine(const WORKLOAD *w, M68_ENGINE engine, uint64_t cycles, uint64_t *done)
+{
+	BENCH bench;
+	uint32_t used;
+	double start, secs;
+
+	if (setup(&bench, w, engine) < 0)
+		return -1;
+	*done = 0;
+	start = now();
+	while (*done < cycles) {
+		m68_run(bench.ctx, 1000000, &used);
+		*done += used;
+	}
+	secs = now() - start;
+	teardown(&bench);
+	return secs;
+}
+
+void
+write_json(FILE *f, const RESULT *results, int n, uint64_t cycles, int repeats)
+{
+	int i;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"cycles\": %llu,\n", (unsigned long long)cycles);
+	fprintf(f, "  \"repeats\": %d,\n", repeats);
+	fprintf(f, "  \"results\": [\n");
+	for (i = 0; i < n; i++) {
+		const RESULT *r = &results[i];
+
+		fprintf(f, "    {\"workload\": \"%s\", \"engine\": \"%s\", \"mips\": %.3f, \"mips_sd\": %.3f, "
+			"\"mhz\": %.3f, \"ns_per_insn\": %.3f}%s\n",
+			r->workload, r->engine, r->mips, r->mips_sd, r->mhz, r->ns, i < n - 1 ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+/*
+ * Compare against a baseline written by -o. Only the layout write_json()
+ * produces is understood: one result object per line.
+ *
+ * @return	Number of regressions, or -1 if the baseline cannot be read
+ */
+int
+compare_baseline(const char *filename, const RESULT *results, int n, double threshold)
+{
+	char line[512];
+	int regressions = 0, matched = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		return -1;
+
+	printf("\n%-8s %-10s %10s %10s %8s\n", "workload", "engine", "baseline", "now", "change");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char workload[32], engine[32];
+		double mips, change;
+		int i;
+
+		if (sscanf(line, " {\"workload\": \"%31[^\"]\", \"engine\": \"%31[^\"]\", \"mips\": %lf",
+		    workload, engine, &mips) != 3)
+			continue;
+		for (i = 0; i < n; i++)
+			if (strcmp(results[i].workload, workload) == 0 && strcmp(results[i].engine, engine) == 0)
+				break;
+		if (i == n || mips <= 0)
+			continue;
+
+		matched++;
+		change = 100.0 * (results[i].mips - mips) / mips;
+		printf("%-8s %-10s %10.1f %10.1f %+7.1f%%%s\n", workload, engine, mips, results[i].mips,
+			change, change < -threshold ? "  REGRESSION" : "");
+		if (change < -threshold)
+			regressions++;
+	}
+	fclose(f);
+
+	if (matched == 0)
+		printf("no results in common with the baseline\n");
+	return regressions;
+}
+
+/*
+ * Render an image as S3 records with 32 data bytes each.
+ */
+size_t
+render_srec(char *out, const uint8_t *img, uint32_t size)
+{
+	uint32_t addr;
+	size_t n = 0;
+	int i;
+
+	for (addr = 0; addr < size; addr += 32) {
+		uint8_t sum = 37 + (addr >> 24) + (addr >> 16) + (addr >> 8) + addr;
+
+		n += sprintf(out + n, "S325%08X", addr);
+		for (i = 0; i < 32; i++) {
+			n += sprintf(out + n, "%02X", img[addr + i]);
+			sum += img[addr + i];
+		}
+		n += sprintf(out + n, "%02X\n", (uint8_t)~sum);
+	}
+	n += sprintf(out + n, "S70500000000FA\n");
+	return n;
+}
+
+/*
+ * Render an image as Intel HEX with 32 data bytes per record.
+ */
+size_t
+render_ihex(char *out, const uint8_t *img, uint32_t size)
+{
+	uint32_t addr;
+	size_t n = 0;
+	int i;
+
+	for (addr = 0; addr < size; addr += 32) {
+		uint8_t sum;
+
+		if ((addr & 0xffff) == 0) {
+			sum = 2 + 4 + (addr >> 24) + (addr >> 16);
+			n += sprintf(out + n, ":02000004%04X%02X\n", addr >> 16, (uint8_t)-sum);
+		}
+		sum = 32 + (addr >> 8) + addr;
+		n += sprintf(out + n, ":20%04X00", addr & 0xffff);
+		for (i = 0; i < 32; i++) {
+			n += sprintf(out + n, "%02X", img[addr + i]);
+			sum += img[addr + i];
+		}
+		n += sprintf(out + n, "%02X\n", (uint8_t)-sum);
+	}
+	n += sprintf(out + n, ":00000001FF\n");
+	return n;
+}
+
+/*
+ * Time loading a LOAD_SIZE image in each format.
+ */
+int
+bench_loader(int repeats)
+{
+	static const char *names[] = { "srec", "ihex", "binary" };
+	static const LOADER_FORMAT formats[] = { LOADER_SREC, LOADER_IHEX, LOADER_BINARY };
+	uint8_t *img = malloc(LOAD_SIZE), *mem = malloc(LOAD_SIZE);
+	char *text = malloc(3 * LOAD_SIZE);
+	int i, rep, rc = 0;
+
+	if (img == NULL || mem == NULL || text == NULL) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		rc = 1;
+		goto out;
+	}
+	for (i = 0; i < LOAD_SIZE; i++)
+		img[i] = i * 7 + (i >> 8);
+
+	printf("%d MB image, %d runs\n\n", LOAD_SIZE >> 20, repeats);
+	printf("%-8s %10s %8s %10s\n", "format", "ms/MB", "+/-", "text MB/s");
+	for (i = 0; i < 3; i++) {
+		const char *data = (const char *)img;
+		size_t len = LOAD_SIZE;
+		double sum = 0, sumsq = 0, ms;
+		LOADER ld;
+
+		if (formats[i] == LOADER_SREC) {
+			len = render_srec(text, img, LOAD_SIZE);
+			data = text;
+		} else if (formats[i] == LOADER_IHEX) {
+			len = render_ihex(text, img, LOAD_SIZE);
+			data = text;
+		}
+
+		for (rep = 0; rep < repeats; rep++) {
+			double start = now();
+
+			loader_init(&ld, mem, LOAD_SIZE);
+			if (loader_load_buffer(&ld, data, len, formats[i]) < 0 ||
+			    memcmp(mem, img, LOAD_SIZE) != 0) {
+				fprintf(stderr, "ERROR: %s image did not load: %s\n", names[i], ld.error ? ld.error : "wrong contents");
+				rc = 1;
+				goto out;
+			}
+			ms = (now() - start) * 1e3 * (1 << 20) / LOAD_SIZE;
+			sum += ms;
+			sumsq += ms * ms;
+		}
+
+		ms = sum / repeats;
+		printf("%-8s %10.2f %8.2f %10.1f\n", names[i], ms,
+			repeats > 1 ? sqrt(fmax(0, (sumsq - sum * sum / repeats) / (repeats - 1))) : 0,
+			len / (ms * 1e-3 * LOAD_SIZE / (1 << 20)) / 1e6);
+	}
+
+out:
+	free(img);
+	free(mem);
+	free(text);
+	return rc;
+}
+
+void
+usage()
+{
+	printf("Usage: m68bench [-d dir] [-n cycles] [-r repeats] [-w workload] [-e engine] [-o out.json] [-b baseline.json [-t percent]]\n");
+	printf("       m68bench -L [-r repeats]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t cycles = 20000000;
+	int repeats = 3;
+	bool loader = false;
+	const char *only_workload = NULL;
+	const char *outfile = NULL, *baseline = NULL;
+	double threshold = DEFAULT_THRESHOLD;
+	M68_ENGINE only_engine = M68_ENGINE_MAX;
+	RESULT results[NWORKLOADS * M68_ENGINE_MAX];
+	int nresults = 0;
+	int i, opt, rep;
+	M68_ENGINE engine;
+
+	while ((opt = getopt(argc, argv, "b:d:e:hLn:o:r:t:w:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'd':
+			workload_dir = optarg;
+			break;
+		case 'e':
+			for (only_engine = 0; only_engine < M68_ENGINE_MAX; only_engine++)
+				if (strcmp(optarg, m68_engine_name(only_engine)) == 0)
+					break;
+			if (only_engine == M68_ENGINE_MAX) {
+				fprintf(stderr, "ERROR: unknown engine %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'L':
+			loader = true;
+			break;
+		case 'n':
+			cycles = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'w':
+			only_workload = optarg;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (cycles == 0 || repeats < 1) {
+		usage();
+		return 1;
+	}
+	if (loader)
+		return bench_loader(repeats);
+
+	printf("%llu cycles per run, %d runs\n\n", (unsigned long long)cycles, repeats);
+	printf("%-8s %-10s %10s %8s %10s %8s\n", "workload", "engine", "MIPS", "+/-", "MHz", "ns/insn");
+
+	for (i = 0; i < NWORKLOADS; i++) {
+		const WORKLOAD *w = &workloads[i];
+		double ipc;
+
+		if (only_workload && strcmp(only_workload, w->name) != 0)
+			continue;
+		ipc = (double)count_insns(w, cycles) / cycles;
+
+		for (engine = 0; engine < M68_ENGINE_MAX; engine++) {
+			RESULT *r = &results[nresults];
+			double sum = 0, sumsq = 0, mhz = 0;
+
+			if (only_engine != M68_ENGINE_MAX && engine != only_engine)
+				continue;
+
+			for (rep = 0; rep < repeats; rep++) {
+				uint64_t done;
+				double secs = run_engine(w, engine, cycles, &done);
+				double mips;
+
+				if (secs <= 0) {
+					fprintf(stderr, "ERROR: cannot set up workload %s\n", w->name);
+					return 1;
+				}
+				mips = ipc * done / secs / 1e6;
+				sum += mips;
+				sumsq += mips * mips;
+				mhz += done / secs / 1e6;
+			}
+
+			r->workload = w->name;
+			r->engine = m68_engine_name(engine);
+			r->mips = sum / repeats;
+			r->mips_sd = repeats > 1 ? sqrt(fmax(0, (sumsq - sum * sum / repeats) / (repeats - 1))) : 0;
+			r->mhz = mhz / repeats;
+			r->ns = 1e3 / r->mips;
+			nresults++;
+
+			printf("%-8s %-10s %10.1f %8.2f %10.1f %8.2f\n",
+				r->workload, r->engine, r->mips, r->mips_sd, r->mhz, r->ns);
+			fflush(stdout);
+		}
+	}
+
+	if (outfile) {
+		FILE *f = fopen(outfile, "w");
+
+		if (f == NULL) {
+			fprintf(stderr, "ERROR: cannot write %s\n", outfile);
+			return 1;
+		}
+		write_json(f, results, nresults, cycles, repeats);
+		fclose(f);
+	}
+
+	if (baseline) {
+		int regressions = compare_baseline(baseline, results, nresults, threshold);
+
+		if (regressions < 0) {
+			fprintf(stderr, "ERROR: cannot read baseline %s\n", baseline);
+			return 1;
+		}
+		if (regressions > 0) {
+			printf("%d regression%s beyond %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+			return 1;
+		}
+	}
+
+	return 0;
+}
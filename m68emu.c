@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "m68emu.h"
@@ -6,6 +7,8 @@
 
 void m68_init(M68_CTX *ctx, const M68_CPUTYPE cpuType)
 {
+	int i;
+
 	switch (cpuType) {
 		case M68_CPU_HC05C4:
 			// 68HC05SC21 is based on the 68HC05C4 core.
@@ -25,17 +28,126 @@ void m68_init(M68_CTX *ctx, const M68_CPUTYPE cpuType)
 	}
 
 	ctx->cpuType = cpuType;
+	ctx->engine = M68_ENGINE_INTERP;
 	ctx->trace = false;
+	ctx->trace_func = NULL;
+	ctx->icache = NULL;
+	ctx->blocks = NULL;
+	ctx->code_map = NULL;
+	ctx->profile = NULL;
+
+	// Start the clock with no events registered
+	ctx->cycles = 0;
+	ctx->deadline = 0;
+	ctx->next_event = M68_NEVER;
+	ctx->nevents = 0;
+	ctx->poll_skipped_cycles = 0;
+	ctx->breakpoint_cycles = M68_NEVER;
+	ctx->is_stopped = false;
+	ctx->stopped_since = 0;
+	ctx->halted_cycles = 0;
+
+	// No peripherals until they register
+	memset(ctx->io_map, 0, sizeof(ctx->io_map));
+	ctx->nio = 0;
+
+	// Start with everything going through the memory callbacks
+	memset(ctx->mem_rd, 0, sizeof(ctx->mem_rd));
+	memset(ctx->mem_wr, 0, sizeof(ctx->mem_wr));
+
+	// Every page is its own memory until told otherwise
+	for (i = 0; i < M68_PAGE_COUNT; i++) {
+		ctx->page_alias[i] = i;
+	}
 
 	m68_reset(ctx);
 }
 
+/**
+ * Map a range of host memory for direct access by the core.
+ *
+ * Accesses to mapped pages bypass the read_mem/write_mem callbacks, so only
+ * plain RAM and ROM should be mapped; pages holding I/O registers must be
+ * left on the callbacks.
+ *
+ * @param	ctx		Emulation context
+ * @param	addr	Emulated start address (page aligned)
+ * @param	size	Size in bytes (multiple of M68_PAGE_SIZE)
+ * @param	mem		Host memory backing 'addr', or NULL to unmap
+ * @param	flags	M68_MAP_READ and/or M68_MAP_WRITE
+ */
+void m68_map_pages(M68_CTX *ctx, const uint16_t addr, const uint32_t size, uint8_t *mem, const int flags)
+{
+	uint32_t ofs;
+
+	assert((addr % M68_PAGE_SIZE) == 0);
+	assert((size % M68_PAGE_SIZE) == 0);
+	assert(addr + size <= 0x10000);
+
+	for (ofs = 0; ofs < size; ofs += M68_PAGE_SIZE) {
+		unsigned int page = (addr + ofs) >> M68_PAGE_SHIFT;
+		uint8_t *host = (mem != NULL) ? mem + ofs : NULL;
+
+		if (flags & M68_MAP_READ) {
+			ctx->mem_rd[page] = host;
+		}
+		if (flags & M68_MAP_WRITE) {
+			ctx->mem_wr[page] = host;
+		}
+	}
+}
+
+/**
+ * Tell the core that a range of pages shows the same memory as another.
+ *
+ * Pages showing the same memory form a ring through page_alias[], which
+ * m68_write_byte() follows so that a write through any alias invalidates
+ * cached code at all of them. Declaring an alias twice is harmless.
+ *
+ * @param	ctx		Emulation context
+ * @param	addr	Emulated start address (page aligned)
+ * @param	size	Size in bytes (multiple of M68_PAGE_SIZE)
+ * @param	alias	Emulated address showing the same memory as 'addr' (page aligned)
+ */
+void m68_alias_pages(M68_CTX *ctx, const uint16_t addr, const uint32_t size, const uint16_t alias)
+{
+	uint32_t ofs;
+
+	assert((addr % M68_PAGE_SIZE) == 0);
+	assert((alias % M68_PAGE_SIZE) == 0);
+	assert((size % M68_PAGE_SIZE) == 0);
+	assert(addr + size <= 0x10000 && alias + size <= 0x10000);
+
+	for (ofs = 0; ofs < size; ofs += M68_PAGE_SIZE) {
+		const uint8_t page = (addr + ofs) >> M68_PAGE_SHIFT;
+		const uint8_t other = (alias + ofs) >> M68_PAGE_SHIFT;
+		uint8_t p = other;
+		uint8_t next;
+
+		// Already on the same ring?
+		do {
+			if (p == page) {
+				break;
+			}
+			p = ctx->page_alias[p];
+		} while (p != other);
+		if (p == page) {
+			continue;
+		}
+
+		// Splice the two rings together by swapping their successors
+		next = ctx->page_alias[page];
+		ctx->page_alias[page] = ctx->page_alias[other];
+		ctx->page_alias[other] = next;
+	}
+}
+
 void m68_reset(M68_CTX *ctx)
 {
 	// Read the reset vector
 	ctx->reg_pc = _M68_RESET_VECTOR & ctx->pc_and;
-	uint16_t rstvec = (uint16_t)ctx->read_mem(ctx, ctx->reg_pc) << 8;
-	rstvec |= ctx->read_mem(ctx, ctx->reg_pc+1);
+	uint16_t rstvec = (uint16_t)m68_read_byte(ctx, ctx->reg_pc) << 8;
+	rstvec |= m68_read_byte(ctx, ctx->reg_pc+1);
 
 	// Set PC to the reset vector
 	ctx->reg_pc = rstvec & ctx->pc_and;
@@ -45,60 +157,274 @@ void m68_reset(M68_CTX *ctx)
 	ctx->reg_sp = 0xFF;
 
 	// Set the I bit in the CCR to 1 (mask off interrupts)
-	ctx->reg_ccr |= M68_CCR_I;
+	m68_set_ccr(ctx, m68_get_ccr(ctx) | M68_CCR_I);
 
-	// Clear STOP and WAIT latches
-	ctx->is_stopped = ctx->is_waiting = 0;
+	// Clear STOP and WAIT latches, restarting the oscillator
+	if (ctx->is_stopped) {
+		m68_clock_resume(ctx);
+	}
+	ctx->is_waiting = 0;
 
-	// Clear external interrupt latch
+	// Clear external interrupt latch and pending requests
 	ctx->irq = 0;
+	ctx->irq_pending = 0;
+
+	// Memory may have been reloaded since the last run
+	m68_icache_flush(ctx);
+	m68_blocks_flush(ctx);
+}
+
+/**
+ * Bit in irq_pending for an interrupt vector.
+ *
+ * Vectors are numbered down from the reset vector, so lower bits belong to
+ * higher priority interrupts.
+ */
+static inline uint16_t irq_bit(const uint16_t vector)
+{
+	assert(vector >= 0xFFE0 && vector <= _M68_INT_VECTOR && (vector & 1) == 0);
+	return 1 << ((0xFFFE - vector) >> 1);
 }
 
+/**
+ * Request an interrupt.
+ *
+ * The request stays pending until withdrawn with m68_irq_clear(), like the
+ * level-sensitive flag outputs of the on-chip peripherals; a device should
+ * clear it once the firmware has acknowledged the interrupt. Requests are
+ * taken between instructions when the I bit is clear, highest priority
+ * (highest vector address) first, and wake the CPU from WAIT. STOP halts
+ * the oscillator, so only M68_VEC_IRQ wakes the CPU from it.
+ *
+ * Safe to call from memory and event callbacks during m68_run().
+ *
+ * @param	ctx		Emulation context
+ * @param	vector	Vector address, e.g. M68_VEC_TIMER
+ */
+void m68_irq(M68_CTX *ctx, const uint16_t vector)
+{
+	if (ctx->irq_pending & irq_bit(vector)) {
+		return;
+	}
+	ctx->irq_pending |= irq_bit(vector);
 
-int m68_exec_cycle(M68_CTX *ctx)
+	// End the current slice so a new request is seen promptly
+	ctx->deadline = ctx->cycles;
+}
+
+/**
+ * Withdraw an interrupt request made with m68_irq().
+ */
+void m68_irq_clear(M68_CTX *ctx, const uint16_t vector)
+{
+	ctx->irq_pending &= ~irq_bit(vector);
+}
+
+/**
+ * Take the highest priority pending interrupt, if the I bit allows.
+ *
+ * @return	Cycles used, 0 if no interrupt was taken
+ */
+static int take_interrupt(M68_CTX *ctx)
+{
+	// With the oscillator stopped, only the IRQ pin can wake the CPU
+	const uint16_t pending = ctx->is_stopped ? ctx->irq_pending & irq_bit(M68_VEC_IRQ) : ctx->irq_pending;
+	int bit;
+
+	if (pending == 0 || (m68_get_ccr(ctx) & M68_CCR_I)) {
+		return 0;
+	}
+	bit = 0;
+	while ((pending & (1 << bit)) == 0) {
+		bit++;
+	}
+	const uint16_t site = ctx->pc_next;
+
+	m68_enter_interrupt(ctx, 0xFFFE - 2 * bit);
+	ctx->cycles += M68_INT_CYCLES;
+	if (ctx->profile != NULL) {
+		m68_profile_interrupt(ctx, site);
+	}
+	return M68_INT_CYCLES;
+}
+
+/**
+ * Release memory allocated by the execution engines.
+ *
+ * Call this before discarding or re-initialising a context.
+ */
+void m68_free(M68_CTX *ctx)
+{
+	int i;
+
+	free(ctx->icache);
+	ctx->icache = NULL;
+
+	if (ctx->blocks != NULL) {
+		free(ctx->blocks->map);
+		free(ctx->blocks->arena);
+		free(ctx->blocks);
+		ctx->blocks = NULL;
+	}
+
+	free(ctx->code_map);
+	ctx->code_map = NULL;
+
+	for (i = 0; i < M68_PAGE_COUNT; i++) {
+		free(ctx->io_map[i]);
+		ctx->io_map[i] = NULL;
+	}
+	ctx->nio = 0;
+
+	m68_profile_free(ctx);
+}
+
+
+/**
+ * Select the opcode table for the context's CPU type
+ */
+static M68_OPTABLE_ENT *get_optable(M68_CTX *ctx)
+{
+	switch (ctx->cpuType) {
+		case M68_CPU_HC05C4:
+			return m68hc05_optable;
+		default:
+			assert(0);
+			return NULL;
+	}
+}
+
+/**
+ * Select the specialized handler table for the context's CPU type
+ */
+static M68_HANDLER_F *get_handlers(M68_CTX *ctx)
+{
+	switch (ctx->cpuType) {
+		case M68_CPU_HC05C4:
+			return m68hc05_handlers;
+		default:
+			assert(0);
+			return NULL;
+	}
+}
+
+const char *m68_engine_name(const M68_ENGINE engine)
+{
+	static const char *names[M68_ENGINE_MAX] = {
+		"interp",
+		"handlers",
+		"threaded",
+		"icache",
+		"block",
+	};
+
+	return (engine < M68_ENGINE_MAX) ? names[engine] : NULL;
+}
+
+/**
+ * Report an illegal instruction.
+ *
+ * @return	-1, for the caller to pass on as its cycle count
+ */
+int m68_illegal(M68_CTX *ctx, const uint8_t opval)
+{
+	M68_OPTABLE_ENT *opcode = &get_optable(ctx)[opval];
+
+	printf("ILLEGAL: pc %04X sp %02X opval %02X mnem '%s' amode %d cycles %d\n",
+		ctx->reg_pc, ctx->reg_sp, opval, opcode->mnem, opcode->amode, opcode->cycles);
+	return -1;
+}
+
+/**
+ * Does this instruction operate on a byte of memory that it may write back?
+ * (BRSET/BRCLR only read theirs.)
+ */
+static inline bool is_memory_operand(const M68_OPTABLE_ENT *opcode)
+{
+	switch (opcode->amode) {
+		case AMODE_DIRECT:
+		case AMODE_EXTENDED:
+		case AMODE_INDEXED0:
+		case AMODE_INDEXED1:
+		case AMODE_INDEXED2:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Fetch the next instruction byte, keeping a copy in 'code' when tracing.
+ */
+static inline uint8_t fetch_byte(M68_CTX *ctx, uint8_t *code, const bool trace)
+{
+	uint8_t value = m68_read_byte(ctx, ctx->pc_next++);
+
+	if (trace) {
+		code[(uint16_t)(ctx->pc_next - 1 - ctx->reg_pc)] = value;
+	}
+	return value;
+}
+
+/**
+ * Execute a single instruction.
+ *
+ * This is inlined into m68_exec_cycle() and m68_run(); 'trace' and 'decode'
+ * are compile-time constants at each call site so the checks are folded away
+ * in the fast paths.
+ *
+ * @return	Number of cycles executed, or -1 for an illegal instruction
+ */
+static M68_ALWAYS_INLINE int exec_insn(M68_CTX *ctx, M68_OPTABLE_ENT *optable, const bool trace, const bool decode, uint8_t *executed)
 {
 	uint8_t opval;
 	M68_OPTABLE_ENT *opcode;
+	uint8_t code[3] = { 0, 0, 0 };	// instruction bytes, only filled in when tracing
+	M68_TRACE_REC rec;
 
 	// Save current program counter
 	ctx->reg_pc = ctx->pc_next;
 
 	// Fetch and decode opcode
-	opval = ctx->read_mem(ctx, ctx->pc_next++);
-	if (ctx->opdecode != NULL) {
+	opval = fetch_byte(ctx, code, trace);
+	if (decode) {
 		opval = ctx->opdecode(ctx, opval);
 	}
-	switch (ctx->cpuType) {
-		case M68_CPU_HC05C4:
-			opcode = &m68hc05_optable[opval];
-			break;
-		default:
-			assert(0);
+	opcode = &optable[opval];
+	if (executed != NULL) {
+		*executed = opval;
 	}
 
-	if (ctx->trace) {
+	if (trace && ctx->trace_func != NULL) {
+		rec.cycles = ctx->cycles;
+		rec.pc = ctx->reg_pc;
+		rec.sp = ctx->reg_sp;
+		rec.a = ctx->reg_acc;
+		rec.x = ctx->reg_x;
+		rec.ccr = m68_get_ccr(ctx);
+	} else if (trace) {
 		printf("M68 EXEC: pc %04X sp %02X opval %02X mnem '%s' amode %d cycles %d\n",
 				ctx->reg_pc, ctx->reg_sp, opval, opcode->mnem, opcode->amode, opcode->cycles);
 	}
 
 	// Read the opcode parameter bytes, if any
 	uint8_t opParam;		// parameter
-	uint16_t dirPtr;		// direct pointer
-	uint16_t opNextPC;		// next PC (if branch or jump)
+	uint16_t dirPtr = 0;	// direct pointer
+	uint16_t opNextPC = 0;	// next PC (if branch or jump)
 	bool opResult;
 
 	switch(opcode->amode) {
 		case AMODE_DIRECT:
 			// Direct addressing: parameter is an address in zero page
-			dirPtr = ctx->read_mem(ctx, ctx->pc_next++);
+			dirPtr = fetch_byte(ctx, code, trace);
 			if (!opcode->write_only) {
-				opParam = ctx->read_mem(ctx, dirPtr);
+				opParam = m68_read_byte(ctx, dirPtr);
 			}
 			break;
 
 		case AMODE_DIRECT_JUMP:
 			// Direct addressing, jump
-			opNextPC = ctx->read_mem(ctx, ctx->pc_next++);
+			opNextPC = fetch_byte(ctx, code, trace);
 			opParam = -1;
 			break;
 
@@ -106,39 +432,39 @@ int m68_exec_cycle(M68_CTX *ctx)
 			// Direct + relative addressing: parameter is an address in zero page
 			//   followed by a relative jump address.
 			// Direct
-			dirPtr = ctx->read_mem(ctx, ctx->pc_next++);
-			opParam = ctx->read_mem(ctx, dirPtr);
+			dirPtr = fetch_byte(ctx, code, trace);
+			opParam = m68_read_byte(ctx, dirPtr);
 			// Relative
 			opNextPC = ctx->pc_next + 1;
-			opNextPC += (int8_t)ctx->read_mem(ctx, ctx->pc_next++);
+			opNextPC += (int8_t)fetch_byte(ctx, code, trace);
 			break;
 
 		case AMODE_EXTENDED:
 			// Extended addressing: parameter is a 16-bit address
-			dirPtr = (uint16_t)ctx->read_mem(ctx, ctx->pc_next++) << 8;
-			dirPtr |= ctx->read_mem(ctx, ctx->pc_next++);
+			dirPtr = (uint16_t)fetch_byte(ctx, code, trace) << 8;
+			dirPtr |= fetch_byte(ctx, code, trace);
 			if (!opcode->write_only) {
-				opParam = ctx->read_mem(ctx, dirPtr);
+				opParam = m68_read_byte(ctx, dirPtr);
 			}
 			break;
 
 		case AMODE_EXTENDED_JUMP:
 			// Extended addressing, jump
-			opNextPC = (uint16_t)ctx->read_mem(ctx, ctx->pc_next++) << 8;
-			opNextPC |= ctx->read_mem(ctx, ctx->pc_next++);
+			opNextPC = (uint16_t)fetch_byte(ctx, code, trace) << 8;
+			opNextPC |= fetch_byte(ctx, code, trace);
 			opParam = -1;
 			break;
 
 		case AMODE_IMMEDIATE:
 			// Immediate addressing: parameter is an immediate value following the opcode
-			opParam = ctx->read_mem(ctx, ctx->pc_next++);
+			opParam = fetch_byte(ctx, code, trace);
 			break;
 
 		case AMODE_INDEXED0:
 			// Indexed with no offset. Take the X register as an address.
 			dirPtr = ctx->reg_x;
 			if (!opcode->write_only) {
-				opParam = ctx->read_mem(ctx, dirPtr);
+				opParam = m68_read_byte(ctx, dirPtr);
 			}
 			break;
 
@@ -150,32 +476,32 @@ int m68_exec_cycle(M68_CTX *ctx)
 
 		case AMODE_INDEXED1:
 			// Indexed with 1-byte offset. Add X and offset.
-			dirPtr = (uint16_t)ctx->read_mem(ctx, ctx->pc_next++) + ctx->reg_x;
+			dirPtr = (uint16_t)fetch_byte(ctx, code, trace) + ctx->reg_x;
 			if (!opcode->write_only) {
-				opParam = ctx->read_mem(ctx, dirPtr);
+				opParam = m68_read_byte(ctx, dirPtr);
 			}
 			break;
 
 		case AMODE_INDEXED1_JUMP:
 			// Indexed jump with 1-byte offset. Take the X register as an address.
-			opNextPC = (uint16_t)ctx->read_mem(ctx, ctx->pc_next++) + ctx->reg_x;
+			opNextPC = (uint16_t)fetch_byte(ctx, code, trace) + ctx->reg_x;
 			opParam = -1;
 			break;
 
 		case AMODE_INDEXED2:
 			// Indexed with 2-byte offset. Add X and offset.
-			dirPtr = (uint16_t)ctx->read_mem(ctx, ctx->pc_next++) << 8;
-			dirPtr |= ctx->read_mem(ctx, ctx->pc_next++);
+			dirPtr = (uint16_t)fetch_byte(ctx, code, trace) << 8;
+			dirPtr |= fetch_byte(ctx, code, trace);
 			dirPtr += ctx->reg_x;
 			if (!opcode->write_only) {
-				opParam = ctx->read_mem(ctx, dirPtr);
+				opParam = m68_read_byte(ctx, dirPtr);
 			}
 			break;
 
 		case AMODE_INDEXED2_JUMP:
 			// Indexed jump with 2-byte offset. Add X and offset.
-			opNextPC = (uint16_t)ctx->read_mem(ctx, ctx->pc_next++) << 8;
-			opNextPC |= ctx->read_mem(ctx, ctx->pc_next++);
+			opNextPC = (uint16_t)fetch_byte(ctx, code, trace) << 8;
+			opNextPC |= fetch_byte(ctx, code, trace);
 			opNextPC += ctx->reg_x;
 			opParam = -1;
 			break;
@@ -198,22 +524,39 @@ int m68_exec_cycle(M68_CTX *ctx)
 		case AMODE_RELATIVE:
 			// Relative addressing: signed relative branch or jump.
 			opNextPC = ctx->pc_next + 1;
-			opNextPC += (int8_t)ctx->read_mem(ctx, ctx->pc_next++);
+			opNextPC += (int8_t)fetch_byte(ctx, code, trace);
 			break;
 
 		case AMODE_ILLEGAL:
 		case AMODE_MAX:
 			// Illegal instruction
-			printf("ILLEGAL: pc %04X sp %02X opval %02X mnem '%s' amode %d cycles %d\n",
-				ctx->reg_pc, ctx->reg_sp, opval, opcode->mnem, opcode->amode, opcode->cycles);
-			//assert(1==2);
-			return -1;
-			break;
+			return m68_illegal(ctx, opval);
+	}
+
+	if (trace && ctx->trace_func != NULL) {
+		// The operand fetches have left pc_next just past the instruction
+		rec.len = ctx->pc_next - ctx->reg_pc;
+		rec.code[0] = opval;
+		rec.code[1] = code[1];
+		rec.code[2] = code[2];
+		rec.ncycles = opcode->cycles;
+		rec.access = 0;
+		rec.ea = dirPtr;
+		if ((is_memory_operand(opcode) && !opcode->write_only) || opcode->amode == AMODE_DIRECT_REL) {
+			rec.access = M68_TRACE_RD;
+			rec.rd = opParam;
+		}
 	}
 
 	// Execute opcode
 	opResult = opcode->opfunc(ctx, opval, &opParam);
-	if (ctx->trace) {
+	if (trace && ctx->trace_func != NULL) {
+		if (opResult && is_memory_operand(opcode)) {
+			rec.access |= M68_TRACE_WR;
+			rec.wr = opParam;
+		}
+		ctx->trace_func(ctx, &rec);
+	} else if (trace) {
 		if (opResult) {
 			printf("\t-> %3d (0x%02X)\n", opParam, opParam);
 		}
@@ -232,7 +575,7 @@ int m68_exec_cycle(M68_CTX *ctx)
 			// Indexed with 1-byte offset. Add X and offset.
 			// Indexed with 2-byte offset. Add X and offset.
 			if (opResult) {
-				ctx->write_mem(ctx, dirPtr, opParam);
+				m68_write_byte(ctx, dirPtr, opParam);
 			}
 			break;
 
@@ -286,3 +629,521 @@ int m68_exec_cycle(M68_CTX *ctx)
 	return opcode->cycles;
 }
 
+/**
+ * Execute a single instruction, or take a pending interrupt.
+ *
+ * A CPU in WAIT skips ahead to the next scheduled event instead; one in
+ * STOP does nothing until an external interrupt.
+ *
+ * @return	Number of cycles executed, or -1 for an illegal instruction
+ */
+int m68_exec_cycle(M68_CTX *ctx)
+{
+	int n = take_interrupt(ctx);
+
+	if (n == 0) {
+		if (ctx->is_waiting || ctx->is_stopped) {
+			if (ctx->is_stopped || ctx->next_event == M68_NEVER) {
+				return 0;
+			}
+			n = ctx->next_event - ctx->cycles;
+			ctx->cycles = ctx->next_event;
+		} else {
+			uint8_t opval;
+
+			if (ctx->trace) {
+				n = exec_insn(ctx, get_optable(ctx), true, ctx->opdecode != NULL, &opval);
+			} else {
+				n = exec_insn(ctx, get_optable(ctx), false, ctx->opdecode != NULL, &opval);
+			}
+			if (n < 0) {
+				return n;
+			}
+			ctx->cycles += n;
+			if (ctx->profile != NULL) {
+				m68_profile_insn(ctx, opval, n);
+			}
+		}
+	}
+	if (ctx->cycles >= ctx->next_event && !ctx->is_stopped) {
+		m68_event_dispatch(ctx);
+	}
+	return n;
+}
+
+/**
+ * Execute a single instruction through the specialized handler table.
+ *
+ * 'executed', when not NULL, returns the opcode run; the lean loops pass a
+ * constant NULL.
+ */
+static M68_ALWAYS_INLINE int exec_handler(M68_CTX *ctx, M68_HANDLER_F *handlers, const bool decode, uint8_t *executed)
+{
+	uint8_t opval;
+
+	ctx->reg_pc = ctx->pc_next;
+	opval = m68_read_byte(ctx, ctx->pc_next++);
+	if (decode) {
+		opval = ctx->opdecode(ctx, opval);
+	}
+	if (executed != NULL) {
+		*executed = opval;
+	}
+	return handlers[opval](ctx);
+}
+
+/**
+ * Execute a single instruction through the predecoded instruction cache.
+ *
+ * Instructions that cannot be cached (fetched from unmapped pages, or from
+ * beyond the PC range) go through the specialized handler table.
+ */
+static M68_ALWAYS_INLINE int exec_cached(M68_CTX *ctx, M68_HANDLER_F *handlers, const bool decode, uint8_t *executed)
+{
+	uint16_t pc = ctx->pc_next;
+
+	if (pc <= ctx->pc_and) {
+		M68_UOP *uop = &ctx->icache[pc];
+
+		if (uop->exec != NULL || m68_icache_fill(ctx, pc)) {
+			ctx->reg_pc = pc;
+			ctx->pc_next = uop->next;
+			if (executed != NULL) {
+				*executed = uop->opval;
+			}
+			return uop->exec(ctx, uop);
+		}
+	}
+	return exec_handler(ctx, handlers, decode, executed);
+}
+
+/**
+ * Run loop body shared by the m68_run() variants.
+ *
+ * Runs until ctx->cycles reaches ctx->deadline. 'instrumented' is a
+ * compile-time constant at each call site: the lean variant has no
+ * breakpoint, trace or profiler checks at all, the instrumented one checks
+ * the breakpoint, feeds the profiler if it is enabled and, in the
+ * reference interpreter, traces when ctx->trace is set.
+ *
+ * The breakpoint does not fire again at the cycle count where it last
+ * fired, so calling m68_run() again after M68_EXIT_BREAKPOINT makes
+ * progress.
+ */
+static M68_ALWAYS_INLINE M68_EXIT run_loop(M68_CTX *ctx, const bool instrumented, const bool decode, const M68_ENGINE engine)
+{
+	M68_OPTABLE_ENT *optable = get_optable(ctx);
+	M68_HANDLER_F *handlers = get_handlers(ctx);
+	const uint32_t bp = ctx->breakpoint_set ? ctx->breakpoint : 0x10000;
+	const bool trace = instrumented && ctx->trace;
+	const bool profile = instrumented && ctx->profile != NULL;
+	M68_EXIT reason = M68_EXIT_BUDGET;
+
+	while (ctx->cycles < ctx->deadline) {
+		if (instrumented && ctx->pc_next == bp && ctx->cycles != ctx->breakpoint_cycles) {
+			ctx->breakpoint_cycles = ctx->cycles;
+			reason = M68_EXIT_BREAKPOINT;
+			break;
+		}
+		if (ctx->stop_request) {
+			ctx->stop_request = false;
+			reason = M68_EXIT_STOP_REQUEST;
+			break;
+		}
+
+		// Only the instrumented loop asks which opcode ran
+		uint8_t opval;
+		uint8_t *executed = instrumented ? &opval : NULL;
+		int n;
+		switch (engine) {
+			case M68_ENGINE_HANDLERS:
+				n = exec_handler(ctx, handlers, decode, executed);
+				break;
+			case M68_ENGINE_ICACHE:
+				n = exec_cached(ctx, handlers, decode, executed);
+				break;
+			default:
+				if (trace) {
+					n = exec_insn(ctx, optable, true, decode, executed);
+				} else {
+					n = exec_insn(ctx, optable, false, decode, executed);
+				}
+				break;
+		}
+		if (n < 0) {
+			reason = M68_EXIT_ILLEGAL;
+			break;
+		}
+		ctx->cycles += n;
+		if (profile) {
+			m68_profile_insn(ctx, opval, n);
+		}
+	}
+
+	return reason;
+}
+
+/**
+ * Execute a translated block, advancing ctx->cycles as it goes. The block
+ * is left early if the code it translates is overwritten or the deadline
+ * passes, and the run loop carries on from pc_next.
+ *
+ * @return	false for an illegal instruction
+ */
+static inline bool exec_block(M68_CTX *ctx, const M68_BLOCK *blk)
+{
+	const uint32_t generation = ctx->blocks->generation;
+	int i;
+
+	for (i = 0; i < blk->count; i++) {
+		const M68_UOP *uop = &blk->uops[i];
+
+		ctx->reg_pc = uop->pc;
+		ctx->pc_next = uop->next;
+		if (uop->exec(ctx, uop) < 0) {
+			return false;
+		}
+		ctx->cycles += uop->cycles;
+
+		if (ctx->blocks->generation != generation) {
+			// The block overwrote translated code; stop here and let the
+			// run loop retranslate from pc_next.
+			break;
+		}
+		if (ctx->cycles >= ctx->deadline) {
+			// An interrupt request, CLI or a newly scheduled event cut the
+			// slice short; stop so it is seen at the same instruction as
+			// the interpreter sees it.
+			break;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Execute a polling loop block, skipping ahead once it has settled.
+ *
+ * A poll block branches back to its own entry and never writes memory. If
+ * a pass leaves the registers exactly as it found them, every further pass
+ * reads the same values and does the same thing until something outside
+ * the CPU changes; devices only do that from events, and host input only
+ * arrives between m68_run() calls. So the passes up to the deadline are
+ * skipped, charging the cycles they would have taken.
+ *
+ * This relies on I/O reads having no side effects that change the value
+ * of a later read, other than through a scheduled event.
+ *
+ * @return	false for an illegal instruction
+ */
+static inline bool exec_poll_block(M68_CTX *ctx, const M68_BLOCK *blk)
+{
+	const uint8_t a = ctx->reg_acc, x = ctx->reg_x, ccr = m68_get_ccr(ctx);
+	const uint16_t sp = ctx->reg_sp;
+	uint64_t passes;
+
+	if (!exec_block(ctx, blk)) {
+		return false;
+	}
+	if (ctx->pc_next != blk->pc || ctx->cycles >= ctx->deadline ||
+		ctx->reg_acc != a || ctx->reg_x != x || ctx->reg_sp != sp ||
+		m68_get_ccr(ctx) != ccr) {
+		return true;
+	}
+
+	passes = (ctx->deadline - ctx->cycles + blk->cycles - 1) / blk->cycles;
+	ctx->cycles += passes * blk->cycles;
+	ctx->poll_skipped_cycles += passes * blk->cycles;
+	return true;
+}
+
+/**
+ * Execute a countdown loop block in closed form.
+ *
+ * Each pass decrements the counter and branches back while it is non-zero,
+ * so the number of passes left is the counter value (256 for zero), or
+ * fewer if the deadline comes first. All but the last of those passes are
+ * skipped by adjusting the counter and cycle count; the last runs normally
+ * so the flags come out exactly as interpretation leaves them.
+ *
+ * @return	false for an illegal instruction
+ */
+static inline bool exec_countdown_block(M68_CTX *ctx, const M68_BLOCK *blk)
+{
+	uint64_t passes, limit;
+	uint8_t count;
+
+	switch (blk->loop) {
+		case M68_LOOP_COUNT_A:
+			count = ctx->reg_acc;
+			break;
+		case M68_LOOP_COUNT_X:
+			count = ctx->reg_x;
+			break;
+		default: {
+			// Only RAM can be updated behind the loop's back: not I/O,
+			// not cached code and not a page mapped read-only
+			const uint16_t addr = blk->loop_addr;
+			const unsigned int page = addr >> M68_PAGE_SHIFT;
+
+			if (m68_io_find(ctx, addr) != NULL || ctx->mem_wr[page] != ctx->mem_rd[page] ||
+				m68_code_cached(ctx, addr)) {
+				return exec_block(ctx, blk);
+			}
+			count = m68_read_byte(ctx, addr);
+			break;
+		}
+	}
+
+	passes = (count != 0) ? count : 256;
+	limit = (ctx->deadline - ctx->cycles + blk->cycles - 1) / blk->cycles;
+	if (limit < passes) {
+		passes = limit;
+	}
+	if (passes <= 1) {
+		return exec_block(ctx, blk);
+	}
+
+	count -= passes - 1;
+	switch (blk->loop) {
+		case M68_LOOP_COUNT_A:
+			ctx->reg_acc = count;
+			break;
+		case M68_LOOP_COUNT_X:
+			ctx->reg_x = count;
+			break;
+		default:
+			// A page behind the callbacks may still drop the write
+			m68_write_byte(ctx, blk->loop_addr, count);
+			if (m68_read_byte(ctx, blk->loop_addr) != count) {
+				return exec_block(ctx, blk);
+			}
+			break;
+	}
+	ctx->cycles += (passes - 1) * blk->cycles;
+	return exec_block(ctx, blk);
+}
+
+/**
+ * Run loop for the block engine.
+ *
+ * Lean only: instrumented runs use the per-instruction loops. The stop
+ * request is checked at block boundaries; the deadline after every
+ * instruction, like the other engines.
+ */
+static M68_EXIT run_blocks(M68_CTX *ctx, const bool decode)
+{
+	M68_HANDLER_F *handlers = get_handlers(ctx);
+	M68_BLOCK **map = ctx->blocks->map;
+	M68_EXIT reason = M68_EXIT_BUDGET;
+
+	while (ctx->cycles < ctx->deadline) {
+		uint16_t pc = ctx->pc_next;
+		M68_BLOCK *blk = NULL;
+		int n;
+
+		if (ctx->stop_request) {
+			ctx->stop_request = false;
+			reason = M68_EXIT_STOP_REQUEST;
+			break;
+		}
+
+		if (pc <= ctx->pc_and) {
+			blk = map[pc];
+			if (blk == NULL) {
+				blk = m68_block_translate(ctx, pc);
+			}
+		}
+
+		if (blk != NULL) {
+			bool ok;
+
+			switch (blk->loop) {
+				case M68_LOOP_NONE:
+					ok = exec_block(ctx, blk);
+					break;
+				case M68_LOOP_POLL:
+					ok = exec_poll_block(ctx, blk);
+					break;
+				default:
+					ok = exec_countdown_block(ctx, blk);
+					break;
+			}
+			if (!ok) {
+				reason = M68_EXIT_ILLEGAL;
+				break;
+			}
+		} else {
+			// Not translatable (e.g. executing from I/O space)
+			n = exec_handler(ctx, handlers, decode, NULL);
+			if (n < 0) {
+				reason = M68_EXIT_ILLEGAL;
+				break;
+			}
+			ctx->cycles += n;
+		}
+	}
+
+	return reason;
+}
+
+/**
+ * Does this run need the instrumented loops?
+ */
+static inline bool is_instrumented(const M68_CTX *ctx)
+{
+	return ctx->trace || ctx->breakpoint_set || ctx->profile != NULL;
+}
+
+/**
+ * Run the selected engine until ctx->deadline, checking the breakpoint
+ * after every instruction, profiling and tracing if enabled.
+ *
+ * The block and threaded engines have no instrumented variant; they fall
+ * back to the instruction cache and the handler table.
+ */
+static M68_EXIT run_instrumented(M68_CTX *ctx, const bool decode)
+{
+	// Tracing is only implemented by the reference interpreter
+	if (ctx->trace) {
+		return run_loop(ctx, true, decode, M68_ENGINE_INTERP);
+	}
+
+	switch (ctx->engine) {
+		case M68_ENGINE_BLOCK:
+		case M68_ENGINE_ICACHE:
+			if (ctx->icache != NULL || m68_icache_alloc(ctx)) {
+				return run_loop(ctx, true, decode, M68_ENGINE_ICACHE);
+			}
+			// fall through
+
+		case M68_ENGINE_THREADED:
+		case M68_ENGINE_HANDLERS:
+			return run_loop(ctx, true, decode, M68_ENGINE_HANDLERS);
+
+		case M68_ENGINE_INTERP:
+		default:
+			return run_loop(ctx, true, decode, M68_ENGINE_INTERP);
+	}
+}
+
+/**
+ * Run the selected engine until ctx->deadline.
+ */
+static M68_EXIT run_engine(M68_CTX *ctx)
+{
+	const bool decode = (ctx->opdecode != NULL);
+
+	// Hoist the instrumentation and opcode decode checks out of the loop:
+	// everything below this is a lean loop.
+	if (is_instrumented(ctx)) {
+		return run_instrumented(ctx, decode);
+	}
+
+	switch (ctx->engine) {
+		case M68_ENGINE_BLOCK:
+			if (ctx->blocks != NULL || m68_blocks_alloc(ctx)) {
+				return run_blocks(ctx, decode);
+			}
+			// fall through
+
+		case M68_ENGINE_ICACHE:
+			if (ctx->icache != NULL || m68_icache_alloc(ctx)) {
+				if (decode) {
+					return run_loop(ctx, false, true, M68_ENGINE_ICACHE);
+				} else {
+					return run_loop(ctx, false, false, M68_ENGINE_ICACHE);
+				}
+			}
+			// Out of memory, run uncached
+			// fall through
+
+		case M68_ENGINE_THREADED:
+#ifdef M68_HAVE_COMPUTED_GOTO
+			if (!decode && ctx->cpuType == M68_CPU_HC05C4) {
+				return m68hc05_run_threaded(ctx);
+			}
+#endif
+			// Fall back to the portable handler loop
+			// fall through
+
+		case M68_ENGINE_HANDLERS:
+			if (decode) {
+				return run_loop(ctx, false, true, M68_ENGINE_HANDLERS);
+			} else {
+				return run_loop(ctx, false, false, M68_ENGINE_HANDLERS);
+			}
+
+		case M68_ENGINE_INTERP:
+		default:
+			if (decode) {
+				return run_loop(ctx, false, true, M68_ENGINE_INTERP);
+			} else {
+				return run_loop(ctx, false, false, M68_ENGINE_INTERP);
+			}
+	}
+}
+
+/**
+ * Run for (at least) 'cycle_budget' cycles.
+ *
+ * Execution is split into slices that end at the next scheduled event, so
+ * peripherals are only called when they have work to do. Interrupts are
+ * taken between slices. While the CPU is in WAIT the cycle count jumps
+ * straight to the next event (or the end of the budget). In STOP the
+ * oscillator is halted: no events fire, and the budget runs out unless an
+ * external interrupt (M68_VEC_IRQ) arrives.
+ *
+ * @param	ctx				Emulation context
+ * @param	cycle_budget	Cycles to run; engines stop at the first
+ *							instruction (or block) boundary at or past it
+ * @param	cycles			Returns the number of cycles executed, may be NULL
+ * @return	Reason for returning
+ */
+M68_EXIT m68_run(M68_CTX *ctx, const uint32_t cycle_budget, uint32_t *cycles)
+{
+	const uint64_t start = ctx->cycles;
+	const uint64_t end = start + cycle_budget;
+	M68_EXIT reason = M68_EXIT_BUDGET;
+
+	while (ctx->cycles < end) {
+		if (ctx->cycles >= ctx->next_event && !ctx->is_stopped) {
+			m68_event_dispatch(ctx);
+		}
+		if (take_interrupt(ctx)) {
+			continue;
+		}
+		if (ctx->is_stopped) {
+			// Peripherals are halted too; only the IRQ pin can wake us
+			ctx->cycles = end;
+			continue;
+		}
+		if (ctx->is_waiting) {
+			// Nothing to do until an event raises an interrupt
+			ctx->cycles = (ctx->next_event < end) ? ctx->next_event : end;
+			continue;
+		}
+		// Catch a breakpoint reached by an interrupt or the end of a slice
+		if (ctx->breakpoint_set && ctx->pc_next == ctx->breakpoint && ctx->cycles != ctx->breakpoint_cycles) {
+			ctx->breakpoint_cycles = ctx->cycles;
+			reason = M68_EXIT_BREAKPOINT;
+			break;
+		}
+
+		ctx->deadline = (ctx->next_event < end) ? ctx->next_event : end;
+		reason = run_engine(ctx);
+		if (reason != M68_EXIT_BUDGET) {
+			break;
+		}
+	}
+
+	// Deliver anything that fell due during the last instruction
+	if (ctx->cycles >= ctx->next_event && !ctx->is_stopped) {
+		m68_event_dispatch(ctx);
+	}
+
+	if (cycles != NULL) {
+		*cycles = ctx->cycles - start;
+	}
+	return reason;
+}
@@ -3,17 +3,133 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 typedef enum {
 	M68_CPU_HC05C4
 } M68_CPUTYPE;
 
 struct M68_CTX;
+struct M68_UOP;
+struct M68_BLOCKS;
+struct M68_PROFILE;
+
+/* Direct memory map: the 16-bit address space is split into 256-byte pages */
+#define M68_PAGE_SHIFT	8
+#define M68_PAGE_SIZE	(1 << M68_PAGE_SHIFT)
+#define M68_PAGE_COUNT	(0x10000 >> M68_PAGE_SHIFT)
+
+/* Interrupt vectors for m68_irq(), highest priority first */
+#define M68_VEC_IRQ		0xFFFA		/* External interrupt (IRQ pin) */
+#define M68_VEC_TIMER	0xFFF8		/* Timer */
+#define M68_VEC_SCI		0xFFF6		/* Serial communications interface */
+#define M68_VEC_SPI		0xFFF4		/* Serial peripheral interface */
+
+/* m68_map_pages() flags */
+#define M68_MAP_READ	0x01		/* Reads come straight from host memory */
+#define M68_MAP_WRITE	0x02		/* Writes go straight to host memory */
 
 typedef uint8_t (*M68_READMEM_F)  (struct M68_CTX *ctx, const uint16_t addr);
 typedef void    (*M68_WRITEMEM_F) (struct M68_CTX *ctx, const uint16_t addr, const uint8_t data);
 typedef uint8_t (*M68_OPDECODE_F) (struct M68_CTX *ctx, const uint8_t value);
 
+/**
+ * Execution engines available to m68_run()
+ */
+typedef enum {
+	M68_ENGINE_INTERP,		///< Reference interpreter (m68_exec_cycle)
+	M68_ENGINE_HANDLERS,	///< Generated per-opcode handlers
+	M68_ENGINE_THREADED,	///< Threaded code (computed goto), falls back to HANDLERS
+	M68_ENGINE_ICACHE,		///< Predecoded instruction cache keyed by PC
+	M68_ENGINE_BLOCK,		///< Translated straight-line blocks keyed by entry PC
+	M68_ENGINE_MAX
+} M68_ENGINE;
+
+/**
+ * Reasons for m68_run() to return control to the caller
+ */
+typedef enum {
+	M68_EXIT_BUDGET,		///< Cycle budget was used up
+	M68_EXIT_BREAKPOINT,	///< PC reached the breakpoint address
+	M68_EXIT_ILLEGAL,		///< Illegal instruction encountered
+	M68_EXIT_STOP_REQUEST	///< Caller set stop_request (e.g. from a signal handler)
+} M68_EXIT;
+
+
+/**
+ * Scheduled event callback, see m68_event_register()
+ */
+typedef void (*M68_EVENT_F)(struct M68_CTX *ctx, void *user);
+
+/// Maximum number of events per context
+#define M68_MAX_EVENTS	8
+
+/// Event time for an event that is not scheduled
+#define M68_NEVER		UINT64_MAX
+
+/**
+ * Flag-setting operation whose CCR bits have not been computed yet
+ * (M68_LAZY_FLAGS)
+ */
+typedef struct M68_FLAG_OP {
+	uint8_t			bits;					///< CCR bits still to be computed from this operation
+	uint8_t			a, m, r;				///< Operands and result
+	uint8_t			carry;					///< Carry mode
+} M68_FLAG_OP;
+
+/**
+ * Scheduled event
+ */
+typedef struct M68_EVENT {
+	uint64_t		when;					///< Cycle count at which to fire, or M68_NEVER
+	M68_EVENT_F		func;					///< Callback
+	void *			user;					///< Callback argument
+} M68_EVENT;
+
+/**
+ * Peripheral register handlers, see m68_io_register()
+ */
+typedef uint8_t (*M68_IO_READ_F)  (void *dev, const uint16_t addr);
+typedef void    (*M68_IO_WRITE_F) (void *dev, const uint16_t addr, const uint8_t data);
+
+/// Maximum number of I/O handlers per context
+#define M68_MAX_IO		32
+
+/**
+ * Registered I/O handler
+ */
+typedef struct M68_IO {
+	M68_IO_READ_F	read;					///< Read handler, or NULL to read memory
+	M68_IO_WRITE_F	write;					///< Write handler, or NULL
+	void *			dev;					///< Handler argument
+} M68_IO;
+
+/**
+ * One traced instruction, see M68_CTX::trace_func
+ *
+ * Registers are as they were before the instruction executed.
+ */
+typedef struct M68_TRACE_REC {
+	uint64_t		cycles;					///< Cycle count before the instruction
+	uint16_t		pc;						///< Address of the instruction
+	uint16_t		sp;						///< Stack pointer
+	uint8_t			a, x, ccr;				///< Accumulator, index register and CCR
+	uint8_t			ncycles;				///< Cycles taken by the instruction
+	uint8_t			len;					///< Instruction length, 1 to 3 bytes
+	uint8_t			code[3];				///< Opcode (after opdecode) and operand bytes
+	uint8_t			access;					///< M68_TRACE_RD and/or M68_TRACE_WR
+	uint16_t		ea;						///< Effective address of the memory operand
+	uint8_t			rd, wr;					///< Value read from / written to 'ea'
+} M68_TRACE_REC;
+
+/* M68_TRACE_REC access flags */
+#define M68_TRACE_RD	0x01		/* Instruction read its memory operand */
+#define M68_TRACE_WR	0x02		/* Instruction wrote its memory operand */
+
+/**
+ * Instruction trace callback
+ */
+typedef void (*M68_TRACE_F)(struct M68_CTX *ctx, const M68_TRACE_REC *rec);
 
 /**
  * Emulation context structure
@@ -24,17 +140,45 @@ typedef struct M68_CTX {
 	uint16_t		reg_sp;					///< Stack pointer
 	uint16_t		reg_pc;					///< Program counter for current instruction
 	uint16_t		pc_next;				///< Program counter for next instruction
-	uint8_t			reg_ccr;				///< Condition code register
+	uint8_t			reg_ccr;				///< Condition code register (read with m68_get_ccr())
+	M68_FLAG_OP		lazy[2];				///< Pending flag-setting operations, newest first, with disjoint bits (M68_LAZY_FLAGS)
 	M68_CPUTYPE		cpuType;				///< CPU type
+	M68_ENGINE		engine;					///< Execution engine used by m68_run()
 	bool			irq;					///< IRQ input state
+	uint16_t		irq_pending;			///< Interrupt requests, one bit per vector (see m68_irq())
 	uint16_t		sp_and, sp_or;			///< Stack pointer AND/OR masks
 	uint16_t		pc_and;					///< Program counter AND mask
 	bool			is_stopped;				///< True if processor is stopped
 	bool			is_waiting;				///< True if processor is WAITing
+	uint64_t		stopped_since;			///< Cycle count at which STOP halted the oscillator
+	uint64_t		halted_cycles;			///< Cycles spent in STOP before the current one
 	M68_READMEM_F	read_mem;				///< Memory read callback
 	M68_WRITEMEM_F	write_mem;				///< Memory write callback
 	M68_OPDECODE_F	opdecode;				///< Opcode decode function, or NULL
-	bool			trace;
+	uint8_t *		mem_rd[M68_PAGE_COUNT];	///< Host pointer per readable page, NULL to use read_mem
+	uint8_t *		mem_wr[M68_PAGE_COUNT];	///< Host pointer per writable page, NULL to use write_mem
+	uint8_t			page_alias[M68_PAGE_COUNT];	///< Next page in the ring of pages showing the same memory (see m68_alias_pages())
+	bool			trace;					///< Trace each instruction (reference interpreter only)
+	M68_TRACE_F		trace_func;				///< Trace sink, or NULL to print the trace as text
+	void *			trace_user;				///< Opaque pointer for trace_func
+	struct M68_UOP *icache;					///< Predecoded instructions (M68_ENGINE_ICACHE), or NULL
+	struct M68_BLOCKS *blocks;				///< Translated blocks (M68_ENGINE_BLOCK), or NULL
+	uint8_t *		code_map;				///< Per-address flags for cached code, or NULL
+	uint16_t		breakpoint;				///< Breakpoint address for m68_run()
+	bool			breakpoint_set;			///< True if breakpoint is active
+	uint64_t		breakpoint_cycles;		///< Cycle count at the last M68_EXIT_BREAKPOINT, so the next run steps past it
+	volatile bool	stop_request;			///< Set to make m68_run() return early
+	uint64_t		cycles;					///< Total cycles executed since m68_init()
+	uint64_t		deadline;				///< Cycle count at which the current m68_run() slice ends
+	uint64_t		next_event;				///< Earliest scheduled event time, or M68_NEVER
+	M68_EVENT		events[M68_MAX_EVENTS];	///< Registered events
+	int				nevents;				///< Number of registered events
+	uint8_t *		io_map[M68_PAGE_COUNT];	///< Per page, handler number + 1 for each address (0 for none), or NULL for a page with no I/O
+	M68_IO			io[M68_MAX_IO];			///< Registered I/O handlers
+	int				nio;					///< Number of registered I/O handlers
+	uint64_t		poll_skipped_cycles;	///< Cycles skipped by polling-loop fast-forward
+	struct M68_PROFILE *profile;			///< Profiler state (see m68_profile_enable()), or NULL
+	void *			user;					///< Opaque pointer for the embedder (e.g. its board)
 } M68_CTX;
 
 
@@ -48,6 +192,51 @@ typedef struct M68_CTX {
 
 void m68_init(M68_CTX *ctx, const M68_CPUTYPE cpuType);
 void m68_reset(M68_CTX *ctx);
+void m68_free(M68_CTX *ctx);
+uint8_t m68_get_ccr(M68_CTX *ctx);
+void m68_set_ccr(M68_CTX *ctx, const uint8_t ccr);
+void m68_icache_flush(M68_CTX *ctx);
+void m68_blocks_flush(M68_CTX *ctx);
+void m68_map_pages(M68_CTX *ctx, const uint16_t addr, const uint32_t size, uint8_t *mem, const int flags);
+void m68_alias_pages(M68_CTX *ctx, const uint16_t addr, const uint32_t size, const uint16_t alias);
 int m68_exec_cycle(M68_CTX *ctx);
+const char *m68_engine_name(const M68_ENGINE engine);
+M68_EXIT m68_run(M68_CTX *ctx, const uint32_t cycle_budget, uint32_t *cycles);
+void m68_irq(M68_CTX *ctx, const uint16_t vector);
+void m68_irq_clear(M68_CTX *ctx, const uint16_t vector);
+int m68_event_register(M68_CTX *ctx, M68_EVENT_F func, void *user);
+void m68_event_schedule(M68_CTX *ctx, const int id, const uint64_t when);
+int m68_io_register(M68_CTX *ctx, const uint16_t addr, const uint32_t size, M68_IO_READ_F read, M68_IO_WRITE_F write, void *dev);
+bool m68_profile_enable(M68_CTX *ctx);
+int m68_profile_symbols(M68_CTX *ctx, const char *filename);
+int m68_profile_callgrind(M68_CTX *ctx, FILE *f, const char *cmd);
+int m68_profile_folded(M68_CTX *ctx, FILE *f);
+
+/**
+ * Cycles the oscillator has run: ctx->cycles less the time spent in STOP.
+ *
+ * STOP halts the oscillator, so peripherals clocked from it count their
+ * time with this rather than ctx->cycles. An event for oscillator time 't'
+ * is scheduled at t + ctx->halted_cycles.
+ */
+static inline uint64_t m68_clock(const M68_CTX *ctx)
+{
+	return (ctx->is_stopped ? ctx->stopped_since : ctx->cycles) - ctx->halted_cycles;
+}
+
+/**
+ * Find the I/O handler claiming 'addr': one table lookup.
+ *
+ * @return	The handler registered with m68_io_register(), or NULL
+ */
+static inline const M68_IO *m68_io_find(const M68_CTX *ctx, const uint16_t addr)
+{
+	const uint8_t *map = ctx->io_map[addr >> M68_PAGE_SHIFT];
+
+	if (map == NULL || map[addr & (M68_PAGE_SIZE - 1)] == 0) {
+		return NULL;
+	}
+	return &ctx->io[map[addr & (M68_PAGE_SIZE - 1)] - 1];
+}
 
 #endif // M68EMU_H
@@ -3,25 +3,25 @@
 #include <string.h>
 
 #include <ctype.h>	/* isspace() */
-#include <time.h>	/* nanosleep() */
 #include <getopt.h>	/* getopt() */
 #include <signal.h>	/* signal() */
-#include <sys/ioctl.h>
 #include <termios.h>
+#include <unistd.h>	/* STDIN_FILENO */
 
-#include "uart.h"
-#include "acia.h"
-#include "timer.h"
+#include "board.h"
+#include "image.h"
+#include "input.h"
+#include "pace.h"
+#include "trace.h"
 
-#include "m68emu.h"
 
-
-uint8_t *memspace;
-
-M68_CTX ctx;
+BOARD *board;
 unsigned int memsize = 0x2000;
-uint64_t clockcount = 0;
-long ns_per_clock = 1000000000LL / 3500000;
+PACE pace;
+INPUT *input;
+TRACE *tracer;
+
+M68_ENGINE engine = M68_ENGINE_INTERP;
 
 int verbose = 0;
 int trace = 0;
@@ -31,19 +31,6 @@ uint16_t breakpoint = 0;
 int skipbpt = 0;
 
 
-void delay(int cycles)
-{
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = cycles * ns_per_clock;
-
-	while (true) {
-		int rc = nanosleep(&ts, &ts);
-		if (rc == 0)
-			break;
-	}
-}
-
 void enable_raw_mode()
 {
 	struct termios term;
@@ -62,127 +49,17 @@ void disable_raw_mode()
 	tcsetattr(0, TCSANOW, &term);
 }
 
-bool kbhit()
-{
-	int byteswaiting;
-	ioctl(0, FIONREAD, &byteswaiting);
-	return byteswaiting > 0;
-}
-
 
 void
 handler(int sig)
 {
 	running = 0;
 	skipbpt = 0;
-}
-
-int 
-parse_srec(char *filename, uint8_t *mem, int memsize)
-{
-	char *line = NULL;
-	uint8_t	line_content[128];
-	size_t len = 0;
-	int i, temp;
-	int read;
-	int line_len, line_type, line_address;
-	FILE *sf;
-
-	if (verbose > 2)
-		printf("Opening filename %s \n", filename);
-
-	sf = fopen(filename, "r");
-	if (sf == 0)
-		return -1;
-
-	if (verbose > 2)
-		printf("File open\n");
-
-	while ((read = getline(&line, &len, sf)) != -1) {
-		if (verbose > 2)
-			printf("\nRead %d chars: %s", read, line);
-		if (line[0] != 'S') {
-			if (verbose > 1)
-				printf("--- : invalid\n");
-			return -1;
-		}
-		sscanf(line + 1, "%1X", &line_type);
-		if (line_type == 0)
-			continue;
-		sscanf(line + 2, "%2X", &line_len); line_len -= 3;
-		sscanf(line + 4, "%4X", &line_address);
-		if (verbose > 2)
-			printf("Line len %d B, type %d, address 0x%4.4x\n", line_len, line_type, line_address);
-		if (line_type == 1 || line_type == 9) {
-			for (i = 0; i < line_len; i++) {
-				sscanf(line + 8 + i * 2, "%2X", &temp);
-				line_content[i] = temp;
-			}
-			if (line_address + line_len > memsize) {
-				fprintf(stderr, "ERROR: address too large for memory space (memsize 0x%x, addr 0x%x, offset 0x%x)\n", memsize, line_address, line_len);
-				return -1;
-			}
-			for (i = 0; i < line_len; i++)
-				mem[line_address + i] = line_content[i];
-		}
-		if (verbose > 2) {
-			printf("PM ");
-			for (i = 0; i < line_len; i++)
-				printf("%2.2X", line_content[i]);
-			printf("\n");
-		}
-	}
-	fclose(sf);
-	return 0;
-}
-
-uint8_t
-readfunc(struct M68_CTX *ctx, const uint16_t addr)
-{
-	if (addr == 0x15c7) {
-		ctx->trace = true;
-	}
-	if (verbose && ctx->trace) {
-		printf("	MEM RD %04X = %02X\n", addr, memspace[addr]);
-	}
-
-	if (addr == 0) {
-		return 1;	// I/O pad always high
-	}
-
-	if (uart_active(addr))
-		return uart_read(addr);
-	if (acia_active(addr))
-		return acia_read(addr);
-	if (timer_active(addr))
-		return timer_read(addr);
-
-	return memspace[addr];
+	board->ctx.stop_request = true;
 }
 
 void
-writefunc(struct M68_CTX *ctx, const uint16_t addr, const uint8_t data)
-{
-	if (verbose && ctx->trace) {
-		printf("	MEM WR %04X = %02X\n", addr, data);
-	}
-	memspace[addr] = data;
-
-	if (addr == 0) {
-		printf("#%lu\n", clockcount);
-		printf("%d#", data & 1);
-	}
-
-	if (uart_active(addr))
-		uart_write(addr, data);
-	if (acia_active(addr))
-		acia_write(addr, data);
-	if (timer_active(addr))
-		return timer_write(addr, data);
-}
-
-void
-uart_tx(uint8_t data)
+uart_tx(void *user, uint8_t data)
 {
 	putchar(data);
 	fflush(stdout);
@@ -208,51 +85,67 @@ step(const char *arg)
 		count = strtoull(arg, NULL, 10);
 	if (count > 0) {
 		for (i = 0; i < count-1; i++) {
-			int cycles = m68_exec_cycle(&ctx);
+			int cycles = m68_exec_cycle(&board->ctx);
 			if (cycles < 0)
 				return;
-			timer_add(cycles);
 		}
-		ctx.trace = 1;
-		m68_exec_cycle(&ctx);
-		ctx.trace = 0;
+		/* show the last instruction on the console, even when tracing to a file */
+		board->ctx.trace = 1;
+		board->ctx.trace_func = NULL;
+		m68_exec_cycle(&board->ctx);
+		board->ctx.trace = trace;
+		if (tracer)
+			trace_attach(tracer, &board->ctx);
 	}
 }
 
 void
 cont(const char *arg)
 {
+	M68_EXIT reason;
+	uint32_t cycles;
+	uint8_t ch;
+
 	running = 1;
+	board->ctx.breakpoint = breakpoint;
+	board->ctx.breakpoint_set = (breakpoint != 0);
 	enable_raw_mode();
+	input_start(input);
+	pace_start(&pace);
 	while (running) {
-		if (ctx.pc_next == breakpoint && !skipbpt) {
+		reason = m68_run(&board->ctx, pace.quantum, &cycles);
+		pace_advance(&pace, cycles);
+		if (reason == M68_EXIT_ILLEGAL)
+			goto bail;
+		if (board->rom_trapped) {
+			board->rom_trapped = false;
+			printf("write to ROM at %04x from PC %04x\n", board->rom_trap_addr, board->ctx.reg_pc);
+			goto bail;
+		}
+		if (reason == M68_EXIT_BREAKPOINT) {
 			skipbpt = 1;
 			printf("breakpoint %04x\n", breakpoint);
 			break;
 		}
-		skipbpt = 0;
-		int cycles = m68_exec_cycle(&ctx);
-		if (cycles < 0)
-			goto bail;
-		timer_add(cycles);
-		delay(cycles);
-		if (kbhit()) {
-			int ch = getchar();
-			uart_rx(ch);
-			acia_rx(ch);
+		/* one byte per quantum, and only once the last has been taken */
+		if (!uart_rx_full(board->uart) && input_get(input, &ch)) {
+			uart_rx(board->uart, ch);
+			acia_rx(board->acia, ch);
 		}
-
 	}
 	if (!skipbpt)
 		step(arg);
 bail:
+	input_stop(input);
 	disable_raw_mode();
+	printf("%.3fs emulated in %.3fs (%.2fx real time)\n",
+		pace.cycles / (double)pace.hz, pace_elapsed(&pace), pace_factor(&pace));
 }
 
 void
 run(const char *arg)
 {
-	m68_reset(&ctx);
+	m68_reset(&board->ctx);
 	cont(arg);
 }
 
@@ -274,20 +167,20 @@ void
 show(const char *arg)
 {
 	printf("A: %02x X: %02x SP: %04x PC: %04x CCR: %02x\n",
-		ctx.reg_acc, ctx.reg_x, ctx.reg_sp, ctx.reg_pc, ctx.reg_ccr);
+		board->ctx.reg_acc, board->ctx.reg_x, board->ctx.reg_sp, board->ctx.reg_pc, m68_get_ccr(&board->ctx));
 }
 
 void
 dump(const char* arg)
 {
 	uint16_t addr = strtoul(arg, NULL, 16);
-	printf("%04X: %02x\n", addr, memspace[addr]);
+	printf("%04X: %02x\n", addr, board_peek(board, addr));
 }
 
 void
 jump(const char* arg)
 {
-	ctx.reg_pc = strtoul(arg, NULL, 16);
+	board->ctx.reg_pc = strtoul(arg, NULL, 16);
 }
 
 void help(const char* arg);
@@ -373,29 +266,80 @@ execute(char *line)
 void
 usage()
 {
-	printf("Usage: m68em [-v level] [-t] <srec-file>\n");
+	printf("Usage: m68em [-v level] [-t] [-T tracefile] [-p profile [-s symfile]] [-e engine] [-c hz[xN]|max] [-o offset] [-M mapfile] [-w copy|ignore|trap] <image-file>\n");
 }
 
 int
 main(int argc, char *argv[])
 {
+	const char *tracefile = NULL;
+	const char *profile = NULL;
+	const char *symfile = NULL;
+	const char *mapfile = NULL;
+	uint32_t offset = 0;
+	BOARD_ROM_POLICY rom_policy = BOARD_ROM_COPY;
+	BOARD_CONFIG config;
+	BOARD_ROM *rom;
+	const char *error;
+	LOADER ld;
+	MEMMAP map;
+	MEMMAP_PAGE table[M68_PAGE_COUNT];
 	int opt;
 	int rc;
 
-	while ((opt = getopt(argc, argv, "hc:m:v:t")) != -1) {
+	pace_init(&pace, 3500000, 1.0);
+
+	while ((opt = getopt(argc, argv, "hc:e:m:o:p:s:v:tM:T:w:")) != -1) {
 		switch (opt) {
 		case 'c':
-			ns_per_clock = 1000000000LL / atol(optarg);
+			if (pace_parse(&pace, optarg) < 0) {
+				fprintf(stderr, "ERROR: bad clock %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'e':
+			for (engine = 0; engine < M68_ENGINE_MAX; engine++)
+				if (strcmp(optarg, m68_engine_name(engine)) == 0)
+					break;
+			if (engine == M68_ENGINE_MAX) {
+				fprintf(stderr, "ERROR: unknown engine %s\n", optarg);
+				return 1;
+			}
 			break;
 		case 'm':
 			memsize = strtoul(optarg, NULL, 16);
 			break;
+		case 'M':
+			mapfile = optarg;
+			break;
+		case 'o':
+			offset = strtoul(optarg, NULL, 16);
+			break;
+		case 'p':
+			profile = optarg;
+			break;
+		case 's':
+			symfile = optarg;
+			break;
 		case 'v':
 			verbose = atoi(optarg);
 			break;
 		case 't':
 			trace = 1;
 			break;
+		case 'T':
+			tracefile = optarg;
+			trace = 1;
+			break;
+		case 'w':
+			for (rom_policy = 0; rom_policy < BOARD_ROM_POLICY_MAX; rom_policy++)
+				if (strcmp(optarg, board_rom_policy_name(rom_policy)) == 0)
+					break;
+			if (rom_policy == BOARD_ROM_POLICY_MAX) {
+				fprintf(stderr, "ERROR: unknown ROM write policy %s\n", optarg);
+				return 1;
+			}
+			break;
 		case 'h':
 			usage();
 			return 0;
@@ -410,27 +354,88 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
-	memspace = calloc(memsize, 1);
-	if (memspace == NULL) {
-		fprintf(stderr, "ERROR: cannot allocate %u bytes for memory\n", memsize);
+	if (image_probe(argv[optind])) {
+		/* a board image brings its own memory size and layout */
+		rom = image_open(argv[optind], &config, &error);
+		if (rom == NULL) {
+			fprintf(stderr, "ERROR: %s: %s\n", argv[optind], error);
+			return 1;
+		}
+	} else {
+		board_default_config(&config, memsize);
+		rom = board_rom_new(memsize);
+		if (rom == NULL) {
+			fprintf(stderr, "ERROR: cannot allocate %u bytes for memory\n", memsize);
+			return 1;
+		}
+		rc = board_rom_load(rom, argv[optind], offset, &ld);
+		if (rc < 0) {
+			if (ld.line)
+				fprintf(stderr, "ERROR: %s:%u: %s\n", argv[optind], ld.line, ld.error);
+			else
+				fprintf(stderr, "ERROR: %s: %s\n", argv[optind], ld.error);
+			return 1;
+		}
+		if (verbose > 1)
+			printf("Loaded %u bytes from %s, %04X-%04X\n", ld.bytes, argv[optind], ld.low, ld.high ? ld.high - 1 : 0);
+	}
+
+	if (mapfile) {
+		memmap_init(&map);
+		if (memmap_load_file(&map, mapfile) < 0) {
+			if (map.line)
+				fprintf(stderr, "ERROR: %s:%u: %s\n", mapfile, map.line, map.error);
+			else
+				fprintf(stderr, "ERROR: %s: %s\n", mapfile, map.error);
+			return 1;
+		}
+		if (memmap_compile(&map, config.memsize, table, &error) < 0) {
+			fprintf(stderr, "ERROR: %s: %s\n", mapfile, error);
+			return 1;
+		}
+		config.map = &map;
+	}
+
+	board = board_new_config(&config, rom, uart_tx, NULL);
+	board_rom_unref(rom);
+	if (board == NULL) {
+		fprintf(stderr, "ERROR: cannot allocate board\n");
+		return 1;
+	}
+	board->verbose = verbose;
+	board->rom_policy = rom_policy;
+	board->port_trace = true;
+
+	input = input_new(STDIN_FILENO);
+	if (input == NULL) {
+		fprintf(stderr, "ERROR: cannot set up host input\n");
 		return 1;
 	}
 
-	rc = parse_srec(argv[optind], memspace, memsize);
-	if (rc < 0) {
-		fprintf(stderr, "ERROR: cannot parse srec file\n");
-		return rc;
+	if (tracefile) {
+		tracer = trace_open(tracefile);
+		if (tracer == NULL) {
+			fprintf(stderr, "ERROR: cannot create trace file %s\n", tracefile);
+			return 1;
+		}
+		trace_attach(tracer, &board->ctx);
 	}
 
-	ctx.read_mem	= &readfunc;
-	ctx.write_mem = &writefunc;
-	ctx.opdecode	= NULL;
-	m68_init(&ctx, M68_CPU_HC05C4);
-	ctx.trace = trace;
+	board->ctx.engine = engine;
+	board->ctx.trace = trace;
+	board_map_memory(board);
+	m68_reset(&board->ctx);
 
-	uart_attach(0x0d, uart_tx);
-	acia_attach(0x17f8, uart_tx);
-	timer_attach(0x08);
+	if (profile) {
+		if (!m68_profile_enable(&board->ctx)) {
+			fprintf(stderr, "ERROR: cannot allocate profiler\n");
+			return 1;
+		}
+		if (symfile && m68_profile_symbols(&board->ctx, symfile) < 0) {
+			fprintf(stderr, "ERROR: cannot read symbol file %s\n", symfile);
+			return 1;
+		}
+	}
 
 	signal(SIGINT, handler);
 
@@ -450,6 +455,24 @@ main(int argc, char *argv[])
 		execute(linep);
 	}
 
+	if (profile) {
+		if (board_write_profile(board, profile, argv[optind]) < 0)
+			fprintf(stderr, "ERROR: cannot write profile %s\n", profile);
+		else
+			printf("profile written to %s.callgrind and %s.folded\n", profile, profile);
+	}
+	if (tracer) {
+		uint64_t records = trace_records(tracer);
+
+		board->ctx.trace_func = NULL;
+		if (trace_close(tracer) < 0)
+			fprintf(stderr, "ERROR: writing trace file %s failed\n", tracefile);
+		else
+			printf("%llu instructions traced to %s\n", (unsigned long long)records, tracefile);
+	}
+	input_destroy(input);
+	board_destroy(board);
+
 	return 0;
 }
 
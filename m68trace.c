@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>	/* getopt() */
+
+#include "m68emu.h"
+#include "m68_internal.h"
+#include "trace.h"
+
+/*
+ * Binary trace decoder: renders a trace written by m68em -T as text, one
+ * line per instruction, using the opcode table generated from
+ * optable/opcodes_m68hc05.csv.
+ */
+
+uint64_t limit = UINT64_MAX;
+
+
+int
+get8(FILE *f, uint8_t *v)
+{
+	int ch = getc(f);
+
+	if (ch == EOF)
+		return -1;
+	*v = ch;
+	return 0;
+}
+
+int
+get16(FILE *f, uint16_t *v)
+{
+	uint8_t hi, lo;
+
+	if (get8(f, &hi) < 0 || get8(f, &lo) < 0)
+		return -1;
+	*v = (hi << 8) | lo;
+	return 0;
+}
+
+/*
+ * Read one record, updating 'rec' from the previous one.
+ *
+ * @return	1 for a record, 0 at end of file, -1 for a truncated record
+ */
+int
+read_record(FILE *f, M68_TRACE_REC *rec, bool first)
+{
+	uint8_t flags, ext = 0;
+	uint64_t skew = 0;
+	int ch, i;
+
+	ch = getc(f);
+	if (ch == EOF)
+		return 0;
+	flags = ch;
+
+	if (!first) {
+		rec->cycles += rec->ncycles;
+		rec->pc += rec->len;
+	}
+	rec->len = (flags & TRACE_LEN) + 1;
+	rec->access = 0;
+
+	if ((flags & TRACE_EXT) && get8(f, &ext) < 0)
+		return -1;
+	if ((flags & TRACE_PC) && get16(f, &rec->pc) < 0)
+		return -1;
+	if ((flags & TRACE_A) && get8(f, &rec->a) < 0)
+		return -1;
+	if ((flags & TRACE_X) && get8(f, &rec->x) < 0)
+		return -1;
+	if ((flags & TRACE_SP) && get16(f, &rec->sp) < 0)
+		return -1;
+	if ((flags & TRACE_CCR) && get8(f, &rec->ccr) < 0)
+		return -1;
+	if (ext & TRACE_RD) {
+		if (get16(f, &rec->ea) < 0 || get8(f, &rec->rd) < 0)
+			return -1;
+		rec->access |= M68_TRACE_RD;
+	}
+	if (ext & TRACE_WR) {
+		if (!(ext & TRACE_RD) && get16(f, &rec->ea) < 0)
+			return -1;
+		if (get8(f, &rec->wr) < 0)
+			return -1;
+		rec->access |= M68_TRACE_WR;
+	}
+	if (ext & TRACE_SKEW) {
+		for (i = 0; ; i += 7) {
+			uint8_t b;
+
+			if (i > 63 || get8(f, &b) < 0)
+				return -1;
+			skew |= (uint64_t)(b & 0x7f) << i;
+			if (!(b & 0x80))
+				break;
+		}
+	}
+	rec->cycles += skew;
+	for (i = 0; i < rec->len; i++)
+		if (get8(f, &rec->code[i]) < 0)
+			return -1;
+	rec->ncycles = m68hc05_optable[rec->code[0]].cycles;
+	return 1;
+}
+
+/*
+ * Format the operand of a decoded instruction.
+ */
+void
+format_operand(char *buf, size_t size, const M68_TRACE_REC *rec, const M68_OPTABLE_ENT *opcode)
+{
+	uint16_t next = rec->pc + rec->len;
+	uint16_t w = (rec->code[1] << 8) | rec->code[2];
+
+	switch (opcode->amode) {
+		case AMODE_DIRECT:
+		case AMODE_DIRECT_JUMP:
+			// BSET/BCLR n,dd carry the bit number in the opcode
+			if (rec->code[0] < 0x20)
+				snprintf(buf, size, "%d,$%02X", (rec->code[0] >> 1) & 7, rec->code[1]);
+			else
+				snprintf(buf, size, "$%02X", rec->code[1]);
+			break;
+		case AMODE_DIRECT_REL:
+			snprintf(buf, size, "%d,$%02X,$%04X", (rec->code[0] >> 1) & 7, rec->code[1],
+				(uint16_t)(next + (int8_t)rec->code[2]));
+			break;
+		case AMODE_EXTENDED:
+		case AMODE_EXTENDED_JUMP:
+			snprintf(buf, size, "$%04X", w);
+			break;
+		case AMODE_IMMEDIATE:
+			snprintf(buf, size, "#$%02X", rec->code[1]);
+			break;
+		case AMODE_INDEXED0:
+		case AMODE_INDEXED0_JUMP:
+			snprintf(buf, size, ",X");
+			break;
+		case AMODE_INDEXED1:
+		case AMODE_INDEXED1_JUMP:
+			snprintf(buf, size, "$%02X,X", rec->code[1]);
+			break;
+		case AMODE_INDEXED2:
+		case AMODE_INDEXED2_JUMP:
+			snprintf(buf, size, "$%04X,X", w);
+			break;
+		case AMODE_RELATIVE:
+			snprintf(buf, size, "$%04X", (uint16_t)(next + (int8_t)rec->code[1]));
+			break;
+		default:
+			buf[0] = '\0';
+			break;
+	}
+}
+
+void
+print_record(const M68_TRACE_REC *rec)
+{
+	const M68_OPTABLE_ENT *opcode = &m68hc05_optable[rec->code[0]];
+	char bytes[12], operand[24];
+	int i, n = 0;
+
+	for (i = 0; i < rec->len; i++)
+		n += snprintf(bytes + n, sizeof(bytes) - n, "%02X ", rec->code[i]);
+	format_operand(operand, sizeof(operand), rec, opcode);
+
+	printf("%10llu  %04X  %-9s %-5s %-14s A=%02X X=%02X SP=%04X CCR=%02X",
+		(unsigned long long)rec->cycles, rec->pc, bytes, opcode->mnem, operand,
+		rec->a, rec->x, rec->sp, rec->ccr);
+	if (rec->access & M68_TRACE_RD)
+		printf("  RD %04X=%02X", rec->ea, rec->rd);
+	if (rec->access & M68_TRACE_WR)
+		printf("  WR %04X=%02X", rec->ea, rec->wr);
+	printf("\n");
+}
+
+void
+usage()
+{
+	printf("Usage: m68trace [-n count] <trace-file>\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	M68_TRACE_REC rec;
+	uint64_t count = 0;
+	char magic[5];
+	FILE *f;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "hn:")) != -1) {
+		switch (opt) {
+		case 'n':
+			limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		return 1;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: cannot open %s\n", argv[optind]);
+		return 1;
+	}
+	if (fread(magic, 1, 5, f) != 5 || memcmp(magic, TRACE_MAGIC, 4) != 0) {
+		fprintf(stderr, "ERROR: %s is not a trace file\n", argv[optind]);
+		fclose(f);
+		return 1;
+	}
+	if (magic[4] != TRACE_VERSION) {
+		fprintf(stderr, "ERROR: unsupported trace version %d\n", magic[4]);
+		fclose(f);
+		return 1;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	while (count < limit && (rc = read_record(f, &rec, count == 0)) > 0) {
+		print_record(&rec);
+		count++;
+	}
+	if (rc < 0)
+		fprintf(stderr, "ERROR: truncated record after %llu instructions\n", (unsigned long long)count);
+
+	fclose(f);
+	return rc < 0 ? 1 : 0;
+}
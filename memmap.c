@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memmap.h"
+
+
+static int
+fail(MEMMAP *map, unsigned line, const char *error)
+{
+	map->error = error;
+	map->line = line;
+	return -1;
+}
+
+/**
+ * Start an empty map, with the whole address space unmapped.
+ */
+void
+memmap_init(MEMMAP *map)
+{
+	memset(map, 0, sizeof(*map));
+}
+
+/**
+ * @return	Name of a region type, as written in map files
+ */
+const char *
+memmap_type_name(MEMMAP_TYPE type)
+{
+	static const char *names[MEMMAP_TYPE_MAX] = {
+		"unmapped", "ram", "rom", "eeprom", "io", "mirror"
+	};
+
+	return (type < MEMMAP_TYPE_MAX) ? names[type] : NULL;
+}
+
+/**
+ * Add a region to the map. It must start and end on a CPU page boundary;
+ * a mirror's mask must keep the offset within the page.
+ *
+ * @return	0 on success, -1 on error
+ */
+int
+memmap_add(MEMMAP *map, MEMMAP_TYPE type, uint32_t addr, uint32_t size, uint16_t mask)
+{
+	MEMMAP_REGION *r;
+
+	if (type >= MEMMAP_TYPE_MAX)
+		return fail(map, 0, "unknown region type");
+	if (size == 0 || addr >= 0x10000 || size > 0x10000 - addr)
+		return fail(map, 0, "region outside the address space");
+	if ((addr | size) & (M68_PAGE_SIZE - 1))
+		return fail(map, 0, "region is not a whole number of pages");
+	if (type == MEMMAP_MIRROR && (mask & (M68_PAGE_SIZE - 1)) != M68_PAGE_SIZE - 1)
+		return fail(map, 0, "mirror mask splits a page");
+	if (map->nregions == MEMMAP_MAX_REGIONS)
+		return fail(map, 0, "too many regions");
+
+	r = &map->region[map->nregions++];
+	r->type = type;
+	r->addr = addr;
+	r->size = size;
+	r->mask = (type == MEMMAP_MIRROR) ? mask : 0xffff;
+	return 0;
+}
+
+/**
+ * Read a map file. Each line describes one region:
+ *
+ *	type address size [mask]
+ *
+ * where 'type' is ram, rom, eeprom, io, unmapped or mirror, and only
+ * mirrors take a mask. Numbers are C style, so 0x for hex. Blank lines
+ * and text from '#' to the end of the line are ignored. For example:
+ *
+ *	io		0x0000	0x0100
+ *	ram		0x0100	0x0100
+ *	rom		0x0200	0x1e00
+ *	mirror	0x2000	0xe000	0x1fff	# partial decode: A13-A15 ignored
+ *
+ * @return	0 on success, -1 on error with the reason in map->error
+ */
+int
+memmap_load_file(MEMMAP *map, const char *filename)
+{
+	char buf[256];
+	unsigned line = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		return fail(map, 0, "cannot open file");
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		char name[16], extra[2];
+		long addr, size, mask = 0;
+		char *hash = strchr(buf, '#');
+		MEMMAP_TYPE type;
+		int n;
+
+		line++;
+		if (hash != NULL)
+			*hash = '\0';
+		n = sscanf(buf, "%15s %li %li %li %1s", name, &addr, &size, &mask, extra);
+		if (n <= 0)
+			continue;
+
+		for (type = 0; type < MEMMAP_TYPE_MAX; type++)
+			if (strcmp(name, memmap_type_name(type)) == 0)
+				break;
+		if (type == MEMMAP_TYPE_MAX) {
+			fclose(f);
+			return fail(map, line, "unknown region type");
+		}
+		if (n != (type == MEMMAP_MIRROR ? 4 : 3) || addr < 0 || size < 0 || mask < 0 || mask > 0xffff) {
+			fclose(f);
+			return fail(map, line, type == MEMMAP_MIRROR ?
+				"expected: mirror address size mask" : "expected: type address size");
+		}
+		if (memmap_add(map, type, addr, size, mask) < 0) {
+			fclose(f);
+			map->line = line;
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Compile a map for a board with 'memsize' bytes of memory into a table
+ * with one entry per CPU page. Every region other than a mirror is backed
+ * by board memory at its own address, so must lie within memsize; a
+ * mirror takes on whatever is at its masked address, which must not be
+ * another mirror.
+ *
+ * @return	0 on success, -1 on error with the reason in 'error'
+ */
+int
+memmap_compile(const MEMMAP *map, unsigned int memsize, MEMMAP_PAGE table[M68_PAGE_COUNT], const char **error)
+{
+	const MEMMAP_REGION *owner[M68_PAGE_COUNT] = { NULL };
+	unsigned int i, page;
+
+	for (i = 0; i < map->nregions; i++) {
+		const MEMMAP_REGION *r = &map->region[i];
+
+		if (r->type != MEMMAP_MIRROR && r->type != MEMMAP_UNMAPPED && r->addr + r->size > memsize) {
+			*error = "region beyond memory";
+			return -1;
+		}
+		for (page = r->addr >> M68_PAGE_SHIFT; page < (r->addr + r->size) >> M68_PAGE_SHIFT; page++)
+			owner[page] = r;
+	}
+
+	for (page = 0; page < M68_PAGE_COUNT; page++) {
+		const MEMMAP_REGION *r = owner[page];
+		unsigned int target = page;
+
+		if (r != NULL && r->type == MEMMAP_MIRROR) {
+			target = ((page << M68_PAGE_SHIFT) & r->mask) >> M68_PAGE_SHIFT;
+			r = owner[target];
+			if (r != NULL && r->type == MEMMAP_MIRROR) {
+				*error = "mirror of a mirror";
+				return -1;
+			}
+		}
+		table[page].type = r ? r->type : MEMMAP_UNMAPPED;
+		table[page].phys = (table[page].type == MEMMAP_UNMAPPED) ? 0 : target;
+	}
+	return 0;
+}
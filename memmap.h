@@ -0,0 +1,62 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include <stdint.h>
+
+#include "m68emu.h"
+
+/* most regions in one map */
+#define MEMMAP_MAX_REGIONS	64
+
+/**
+ * What sits behind a region of the address space
+ */
+typedef enum {
+	MEMMAP_UNMAPPED,		///< Nothing: reads return 0xFF, writes are dropped
+	MEMMAP_RAM,				///< Read/write memory, private to each board
+	MEMMAP_ROM,				///< Read-only memory, shared between boards
+	MEMMAP_EEPROM,			///< Non-volatile memory, private to each board
+	MEMMAP_IO,				///< Peripheral registers; never mapped into the CPU
+	MEMMAP_MIRROR,			///< Another region, found by masking the address
+	MEMMAP_TYPE_MAX
+} MEMMAP_TYPE;
+
+/**
+ * One region of a memory map. Regions are whole CPU pages.
+ */
+typedef struct MEMMAP_REGION {
+	MEMMAP_TYPE		type;					///< What the region holds
+	uint32_t		addr;					///< First address
+	uint32_t		size;					///< Bytes
+	uint16_t		mask;					///< MEMMAP_MIRROR: address & mask is the address mirrored
+} MEMMAP_REGION;
+
+/**
+ * Memory map: a list of regions, later ones taking precedence where they
+ * overlap. Addresses no region covers are unmapped.
+ *
+ * A map is only a description; memmap_compile() turns it into a table
+ * with one entry per CPU page, so that no access needs a range check.
+ */
+typedef struct MEMMAP {
+	unsigned		nregions;				///< Regions in use
+	MEMMAP_REGION	region[MEMMAP_MAX_REGIONS];	///< Regions, in file order
+	const char *	error;					///< Reason for failure
+	unsigned		line;					///< Line of the failure, 0 if not tied to a line
+} MEMMAP;
+
+/**
+ * Compiled entry for one CPU page
+ */
+typedef struct MEMMAP_PAGE {
+	uint8_t			type;					///< MEMMAP_TYPE of the memory behind it, never MEMMAP_MIRROR
+	uint8_t			phys;					///< Page of board memory it reads and writes
+} MEMMAP_PAGE;
+
+void memmap_init(MEMMAP *map);
+const char *memmap_type_name(MEMMAP_TYPE type);
+int memmap_add(MEMMAP *map, MEMMAP_TYPE type, uint32_t addr, uint32_t size, uint16_t mask);
+int memmap_load_file(MEMMAP *map, const char *filename);
+int memmap_compile(const MEMMAP *map, unsigned int memsize, MEMMAP_PAGE table[M68_PAGE_COUNT], const char **error);
+
+#endif
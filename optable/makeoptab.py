@@ -206,3 +206,212 @@ if g_outmode == 'optable':
             fname = f"m68op_{opcode.root_mnemonic()}"
             print(f"\t{{ \"{opcode.mnemonic}\", {opcode.addressing_mode.to_c_amode()}, {opcode.cycles}, {opcode.write_only}, &{fname} }},")
     print("};")
+
+# -- fully specialized per-opcode handlers
+#
+# Each handler fuses operand fetch, the operation, write-back and the cycle
+# count for exactly one opcode. The m68op_* functions are static in m68_ops.c
+# and are called with a constant opcode, so the compiler inlines them and
+# folds opcode-derived constants (e.g. the BSET/BRCLR bit number).
+
+def handler_body(ins, predecoded=False):
+    """Return the C statements implementing one instruction.
+
+    With predecoded=False the operands are fetched from the instruction
+    stream at ctx->pc_next. With predecoded=True they come from an M68_UOP
+    ('uop') filled in by m68_uop_decode(), and ctx->pc_next already points
+    at the next instruction.
+    """
+    am = ins.addressing_mode
+    fname = f"m68op_{ins.root_mnemonic()}"
+    call = f"{fname}(ctx, 0x{ins.opcode:02X}, &param)"
+    body = []
+
+    fetch8 = "m68_read_byte(ctx, ctx->pc_next++)"
+
+    def fetch16(var):
+        return [f"uint16_t {var} = (uint16_t){fetch8} << 8;",
+                f"{var} |= {fetch8};"]
+
+    if am in (AddressingMode.DIRECT, AddressingMode.EXTENDED, AddressingMode.INDEXED0,
+              AddressingMode.INDEXED1, AddressingMode.INDEXED2):
+        if am == AddressingMode.INDEXED0:
+            body.append("uint16_t ea = ctx->reg_x;")
+        elif predecoded:
+            if am in (AddressingMode.DIRECT, AddressingMode.EXTENDED):
+                body.append("uint16_t ea = uop->ea;")
+            else:
+                body.append("uint16_t ea = uop->ea + ctx->reg_x;")
+        elif am == AddressingMode.DIRECT:
+            body.append(f"uint16_t ea = {fetch8};")
+        elif am == AddressingMode.EXTENDED:
+            body.extend(fetch16("ea"))
+        elif am == AddressingMode.INDEXED1:
+            body.append(f"uint16_t ea = (uint16_t){fetch8} + ctx->reg_x;")
+        else:
+            body.extend(fetch16("ea"))
+            body.append("ea += ctx->reg_x;")
+        if ins.write_only == "true":
+            body.append("uint8_t param = 0;")
+        else:
+            body.append("uint8_t param = m68_read_byte(ctx, ea);")
+        body.append(f"if ({call}) {{")
+        body.append("\tm68_write_byte(ctx, ea, param);")
+        body.append("}")
+
+    elif am in (AddressingMode.DIRECT_JUMP, AddressingMode.EXTENDED_JUMP, AddressingMode.INDEXED0_JUMP,
+                AddressingMode.INDEXED1_JUMP, AddressingMode.INDEXED2_JUMP, AddressingMode.RELATIVE):
+        if am == AddressingMode.INDEXED0_JUMP:
+            body.append("uint16_t target = ctx->reg_x;")
+        elif predecoded:
+            if am in (AddressingMode.INDEXED1_JUMP, AddressingMode.INDEXED2_JUMP):
+                body.append("uint16_t target = uop->ea + ctx->reg_x;")
+            else:
+                body.append("uint16_t target = uop->target;")
+        elif am == AddressingMode.DIRECT_JUMP:
+            body.append(f"uint16_t target = {fetch8};")
+        elif am == AddressingMode.EXTENDED_JUMP:
+            body.extend(fetch16("target"))
+        elif am == AddressingMode.INDEXED1_JUMP:
+            body.append(f"uint16_t target = (uint16_t){fetch8} + ctx->reg_x;")
+        elif am == AddressingMode.INDEXED2_JUMP:
+            body.extend(fetch16("target"))
+            body.append("target += ctx->reg_x;")
+        else:
+            body.append("uint16_t target = ctx->pc_next + 1;")
+            body.append(f"target += (int8_t){fetch8};")
+        body.append("uint8_t param = -1;")
+        body.append(f"if ({call}) {{")
+        body.append("\tctx->pc_next = target & ctx->pc_and;")
+        body.append("}")
+
+    elif am == AddressingMode.DIRECT_REL:
+        if predecoded:
+            body.append("uint16_t ea = uop->ea;")
+            body.append("uint8_t param = m68_read_byte(ctx, ea);")
+            body.append("uint16_t target = uop->target;")
+        else:
+            body.append(f"uint16_t ea = {fetch8};")
+            body.append("uint8_t param = m68_read_byte(ctx, ea);")
+            body.append("uint16_t target = ctx->pc_next + 1;")
+            body.append(f"target += (int8_t){fetch8};")
+        body.append(f"if ({call}) {{")
+        body.append("\tctx->pc_next = target & ctx->pc_and;")
+        body.append("}")
+
+    elif am == AddressingMode.IMMEDIATE:
+        if predecoded:
+            body.append("uint8_t param = uop->imm;")
+        else:
+            body.append(f"uint8_t param = {fetch8};")
+        body.append(f"{call};")
+
+    elif am == AddressingMode.INHERENT:
+        body.append("uint8_t param = -1;")
+        body.append(f"{call};")
+
+    elif am == AddressingMode.INHERENT_A:
+        body.append("uint8_t param = ctx->reg_acc;")
+        body.append(f"if ({call}) {{")
+        body.append("\tctx->reg_acc = param;")
+        body.append("}")
+
+    elif am == AddressingMode.INHERENT_X:
+        body.append("uint8_t param = ctx->reg_x;")
+        body.append(f"if ({call}) {{")
+        body.append("\tctx->reg_x = param;")
+        body.append("}")
+
+    else:
+        raise ValueError("Cannot generate handler for opcode 0x%02X" % ins.opcode)
+
+    return body
+
+
+if g_outmode == 'handlers':
+    print("/* Generated by makeoptab.py -- do not edit */")
+    print()
+    for n, ins in enumerate(op_table):
+        if ins is None:
+            print(f"/* 0x{n:02X}: illegal */")
+            print(f"static int {g_prefix}_op_{n:02X}(M68_CTX *ctx)")
+            print("{")
+            print(f"\treturn m68_illegal(ctx, 0x{n:02X});")
+            print("}")
+            print()
+            continue
+
+        print(f"/* 0x{n:02X}: {ins.mnemonic} {ins.addressing_mode.to_c_amode()} */")
+        print(f"static int {g_prefix}_op_{n:02X}(M68_CTX *ctx)")
+        print("{")
+        for line in handler_body(ins):
+            print(f"\t{line}")
+        print(f"\treturn {ins.cycles};")
+        print("}")
+        print()
+
+    print(f"M68_HANDLER_F {g_prefix}_handlers[256] = {{")
+    for n in range(256):
+        print(f"\t&{g_prefix}_op_{n:02X},")
+    print("};")
+
+
+# -- threaded-code interpreter body
+#
+# Emitted inside the body of a function using GCC/Clang labels-as-values.
+# The including function defines THREADED_START, THREADED_NEXT(cycles) and
+# THREADED_ILLEGAL(opval); each opcode body ends by dispatching the next one.
+if g_outmode == 'threaded':
+    print("/* Generated by makeoptab.py -- do not edit */")
+    print()
+    print("static const void *const threaded_table[256] = {")
+    for n in range(256):
+        print(f"\t&&op_{n:02X},")
+    print("};")
+    print()
+    print("THREADED_START;")
+    print()
+    for n, ins in enumerate(op_table):
+        if ins is None:
+            print(f"op_{n:02X}: {{\t/* illegal */")
+            print(f"\tTHREADED_ILLEGAL(0x{n:02X});")
+            print("}")
+            continue
+
+        print(f"op_{n:02X}: {{\t/* {ins.mnemonic} {ins.addressing_mode.to_c_amode()} */")
+        for line in handler_body(ins):
+            print(f"\t{line}")
+        print(f"\tTHREADED_NEXT({ins.cycles});")
+        print("}")
+
+
+# -- predecoded-instruction handlers
+#
+# Same operation bodies as the 'handlers' mode, but operands come from an
+# M68_UOP filled in by m68_uop_decode() instead of the instruction stream.
+if g_outmode == 'uops':
+    print("/* Generated by makeoptab.py -- do not edit */")
+    print()
+    for n, ins in enumerate(op_table):
+        if ins is None:
+            print(f"/* 0x{n:02X}: illegal */")
+            print(f"static int {g_prefix}_uop_{n:02X}(M68_CTX *ctx, const M68_UOP *uop)")
+            print("{")
+            print(f"\treturn m68_illegal(ctx, 0x{n:02X});")
+            print("}")
+            print()
+            continue
+
+        print(f"/* 0x{n:02X}: {ins.mnemonic} {ins.addressing_mode.to_c_amode()} */")
+        print(f"static int {g_prefix}_uop_{n:02X}(M68_CTX *ctx, const M68_UOP *uop)")
+        print("{")
+        for line in handler_body(ins, predecoded=True):
+            print(f"\t{line}")
+        print(f"\treturn {ins.cycles};")
+        print("}")
+        print()
+
+    print(f"M68_UOP_F {g_prefix}_uops[256] = {{")
+    for n in range(256):
+        print(f"\t&{g_prefix}_uop_{n:02X},")
+    print("};")
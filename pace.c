@@ -0,0 +1,154 @@
+#include <errno.h>	/* EINTR */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>	/* clock_gettime(), clock_nanosleep() */
+
+#include "pace.h"
+
+/* never sleep for less than this; shorter sleeps cost more than they save */
+#define MIN_SLEEP	0.0005
+
+/* fall no further behind than this, e.g. after the host was suspended */
+#define MAX_LAG		0.05
+
+
+static double
+ts_to_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec * 1e-9;
+}
+
+static struct timespec
+sec_to_ts(double sec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)sec;
+	ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_to_sec(&ts);
+}
+
+/**
+ * Set up pacing for an emulated clock of 'hz', running at 'speed' times
+ * real time (0 to run as fast as possible).
+ */
+void
+pace_init(PACE *pace, uint64_t hz, double speed)
+{
+	memset(pace, 0, sizeof(*pace));
+	pace->hz = hz;
+	pace->speed = speed;
+	pace->quantum = hz / 1000;
+	if (pace->quantum == 0)
+		pace->quantum = 1;
+}
+
+/**
+ * Parse a clock specification: "hz", "hzxN" for N times real time, or
+ * "max" to run unthrottled at the current clock rate.
+ *
+ * @return	0 on success, -1 if 'arg' is malformed
+ */
+int
+pace_parse(PACE *pace, const char *arg)
+{
+	uint64_t hz;
+	double speed = 1.0;
+	char *end;
+
+	if (strcmp(arg, "max") == 0) {
+		pace_init(pace, pace->hz, 0);
+		return 0;
+	}
+
+	hz = strtoull(arg, &end, 0);
+	if (end == arg || hz == 0)
+		return -1;
+	if (*end == 'x') {
+		const char *s = end + 1;
+
+		speed = strtod(s, &end);
+		if (end == s || speed <= 0)
+			return -1;
+	}
+	if (*end != '\0')
+		return -1;
+
+	pace_init(pace, hz, speed);
+	return 0;
+}
+
+/**
+ * Start (or restart) pacing from the current host time.
+ */
+void
+pace_start(PACE *pace)
+{
+	clock_gettime(CLOCK_MONOTONIC, &pace->origin);
+	pace->start = pace->origin;
+	pace->cycles = 0;
+}
+
+/**
+ * Account for 'cycles' emulated cycles, sleeping if emulated time is
+ * ahead of host time.
+ */
+void
+pace_advance(PACE *pace, uint32_t cycles)
+{
+	double start, target, lead;
+
+	pace->cycles += cycles;
+	if (pace->speed == 0)
+		return;
+
+	start = ts_to_sec(&pace->start);
+	target = start + pace->cycles / (pace->hz * pace->speed);
+	lead = target - now();
+
+	if (lead < -MAX_LAG) {
+		/* too far behind to catch up; carry on from here */
+		pace->start = sec_to_ts(start - lead - MAX_LAG);
+	} else if (lead >= MIN_SLEEP) {
+		struct timespec ts = sec_to_ts(target);
+
+		/* an absolute deadline makes resuming after a signal simple */
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+}
+
+/**
+ * @return	Host seconds since pace_start()
+ */
+double
+pace_elapsed(PACE *pace)
+{
+	return now() - ts_to_sec(&pace->origin);
+}
+
+/**
+ * @return	Emulated time divided by host time since pace_start()
+ */
+double
+pace_factor(PACE *pace)
+{
+	double elapsed = pace_elapsed(pace);
+
+	if (elapsed <= 0)
+		return 0;
+	return pace->cycles / (double)pace->hz / elapsed;
+}
@@ -0,0 +1,31 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Real-time pacing: keeps emulated time in step with the host clock.
+ *
+ * The caller runs the core in quanta and reports each one with
+ * pace_advance(), which sleeps only while emulated time is ahead of host
+ * time. Sleeps are to an absolute deadline, so rounding and wakeup latency
+ * never accumulate into drift.
+ */
+typedef struct PACE {
+	uint64_t		hz;						///< Emulated clock rate
+	double			speed;					///< Multiple of real time, 0 for unthrottled
+	uint32_t		quantum;				///< Cycles per m68_run() call (1ms of emulated time)
+	struct timespec	origin;					///< Host time at pace_start()
+	struct timespec	start;					///< Host time of emulated cycle 0, moved on when lagging
+	uint64_t		cycles;					///< Emulated cycles since pace_start()
+} PACE;
+
+void pace_init(PACE *pace, uint64_t hz, double speed);
+int pace_parse(PACE *pace, const char *arg);
+void pace_start(PACE *pace);
+void pace_advance(PACE *pace, uint32_t cycles);
+double pace_elapsed(PACE *pace);
+double pace_factor(PACE *pace);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Lock-free single-producer/single-consumer byte ring.
+ *
+ * One thread may call ring_put() while another calls ring_get(); neither
+ * ever blocks. 'head' is written only by the producer and 'tail' only by
+ * the consumer, and both count up without wrapping into the buffer, so
+ * head - tail is always the number of bytes queued.
+ */
+
+/// Ring capacity in bytes; must be a power of two
+#define RING_SIZE	1024
+
+typedef struct RING {
+	_Atomic uint32_t	head;					///< Next slot to fill (producer)
+	_Atomic uint32_t	tail;					///< Next slot to drain (consumer)
+	uint8_t				buf[RING_SIZE];
+} RING;
+
+static inline void ring_init(RING *ring)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+/**
+ * Queue a byte. Producer side only.
+ *
+ * @return	false if the ring is full and the byte was dropped
+ */
+static inline bool ring_put(RING *ring, uint8_t ch)
+{
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail == RING_SIZE) {
+		return false;
+	}
+	ring->buf[head & (RING_SIZE - 1)] = ch;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * Take the oldest byte. Consumer side only.
+ *
+ * @return	false if the ring is empty
+ */
+static inline bool ring_get(RING *ring, uint8_t *ch)
+{
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail) {
+		return false;
+	}
+	*ch = ring->buf[tail & (RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>	/* getopt() */
+
+#include "board.h"
+#include "image.h"
+#include "loader.h"
+
+/*
+ * Board image builder: loads an S-record, Intel HEX or binary image and
+ * writes it out with the board layout as a board image (see image.h), which
+ * m68em and m68batch start from without parsing anything.
+ *
+ * The loaded span, widened to whole IMAGE_ALIGN pages, is stored as one
+ * ROM region. Memory outside it starts zeroed, as it does when loading
+ * the original image.
+ */
+
+void
+usage()
+{
+	printf("Usage: srec2img [-m memsize] [-o offset] [-u uart] [-a acia] [-t timer] <image-file> <board-image>\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	BOARD_CONFIG config;
+	IMAGE_REGION region;
+	LOADER ld;
+	uint8_t *mem;
+	uint32_t offset = 0;
+	int opt;
+
+	board_default_config(&config, 0x2000);
+
+	while ((opt = getopt(argc, argv, "a:hm:o:t:u:")) != -1) {
+		switch (opt) {
+		case 'a':
+			config.acia_base = strtoul(optarg, NULL, 16);
+			break;
+		case 'm':
+			config.memsize = strtoul(optarg, NULL, 16);
+			break;
+		case 'o':
+			offset = strtoul(optarg, NULL, 16);
+			break;
+		case 't':
+			config.timer_base = strtoul(optarg, NULL, 16);
+			break;
+		case 'u':
+			config.uart_base = strtoul(optarg, NULL, 16);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind + 2 != argc || config.memsize == 0 || config.memsize > 0x10000) {
+		usage();
+		return 1;
+	}
+
+	mem = calloc(config.memsize, 1);
+	if (mem == NULL) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		return 1;
+	}
+	loader_init(&ld, mem, config.memsize);
+	ld.offset = offset;
+	if (loader_load_file(&ld, argv[optind], LOADER_AUTO) < 0) {
+		if (ld.line)
+			fprintf(stderr, "ERROR: %s:%u: %s\n", argv[optind], ld.line, ld.error);
+		else
+			fprintf(stderr, "ERROR: %s: %s\n", argv[optind], ld.error);
+		free(mem);
+		return 1;
+	}
+
+	region.addr = ld.low & ~(uint32_t)(IMAGE_ALIGN - 1);
+	region.size = ((ld.high + IMAGE_ALIGN - 1) & ~(uint32_t)(IMAGE_ALIGN - 1)) - region.addr;
+	if (region.addr + region.size > config.memsize)
+		region.size = config.memsize - region.addr;
+	region.flags = IMAGE_REGION_ROM;
+
+	if (image_write(argv[optind + 1], &config, mem, &region, ld.bytes ? 1 : 0) < 0) {
+		fprintf(stderr, "ERROR: cannot write %s\n", argv[optind + 1]);
+		free(mem);
+		return 1;
+	}
+	printf("%s: %u bytes at %04X-%04X, memsize %04X\n", argv[optind + 1], ld.bytes,
+		ld.low, ld.high ? ld.high - 1 : 0, config.memsize);
+	free(mem);
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "timer.h"
@@ -30,81 +31,165 @@
 #define 	INTDISABLE	(1<<6)
 #define		INTF		(1<<7)
 
+/* cycles between DATA decrements */
+#define PERIOD		((uint64_t)(1 << PRESCALER_MASK) + 1)
 
-static unsigned int baseaddr;
-static uint8_t regs[2];
 
-static int prescaler = (1 << PRESCALER_MASK);
+/*
+ * The counter is not stepped per cycle. 'prescaler' and regs[DATA] hold
+ * the state at oscillator cycle 'base' (see m68_clock(), which stands
+ * still in STOP) and are brought forward in closed form when the
+ * registers are accessed, and by an event when DATA wraps.
+ */
+struct TIMER_CTX {
+	M68_CTX *ctx;
+	unsigned int baseaddr;
+	uint8_t regs[2];
+
+	int prescaler;
+	uint64_t base;
+	int event;
+};
 
 
-static void dump()
+TIMER_CTX *
+timer_new(void)
 {
-	printf("CTRL %02x, DATA %02x\n", regs[CTRL], regs[DATA]);
+	TIMER_CTX *timer = calloc(1, sizeof(TIMER_CTX));
+
+	if (timer != NULL)
+		timer->prescaler = (1 << PRESCALER_MASK);
+	return timer;
 }
 
 void
-timer_attach(uint16_t addr)
+timer_destroy(TIMER_CTX *timer)
 {
-	baseaddr = addr;
+	free(timer);
+}
 
-	regs[DATA] = 0;
-	regs[CTRL] = INTF | INTDISABLE | PRESCALER_MASK;
+/*
+ * Drive the CPU interrupt request from TCR: INTF set and not masked.
+ */
+static void
+timer_update_irq(TIMER_CTX *timer)
+{
+	if ((timer->regs[CTRL] & (INTF | INTDISABLE)) == INTF)
+		m68_irq(timer->ctx, M68_VEC_TIMER);
+	else
+		m68_irq_clear(timer->ctx, M68_VEC_TIMER);
 }
 
-int 
-timer_active(uint16_t addr)
+/*
+ * Bring the counter up to the current cycle.
+ */
+static void
+timer_sync(TIMER_CTX *timer)
 {
-	return (addr >= baseaddr && addr<baseaddr+2);
+	uint64_t elapsed = m68_clock(timer->ctx) - timer->base;
+	uint64_t ticks;
+
+	timer->base = m68_clock(timer->ctx);
+	if (elapsed <= (uint64_t)timer->prescaler) {
+		timer->prescaler -= elapsed;
+		return;
+	}
+
+	/* first tick after prescaler+1 cycles, then one every PERIOD */
+	elapsed -= timer->prescaler + 1;
+	ticks = 1 + elapsed / PERIOD;
+	timer->prescaler = (PERIOD - 1) - elapsed % PERIOD;
+
+	/* the tick that takes DATA from 0 to 0xff raises the interrupt flag */
+	if (ticks > timer->regs[DATA]) {
+		timer->regs[CTRL] |= INTF;
+		timer_update_irq(timer);
+	}
+	timer->regs[DATA] -= ticks;
 }
 
-uint8_t
-timer_read(uint16_t addr)
+/*
+ * Schedule the event for the next time DATA wraps.
+ */
+static void
+timer_schedule(TIMER_CTX *timer)
 {
-	int idx = (addr - baseaddr);
-	uint8_t ch = regs[idx];
+	m68_event_schedule(timer->ctx, timer->event, timer->ctx->halted_cycles +
+		timer->base + timer->prescaler + 1 + timer->regs[DATA] * PERIOD);
+}
+
+static void
+timer_event(M68_CTX *ctx, void *user)
+{
+	TIMER_CTX *timer = user;
+
+	timer_sync(timer);
+	timer_schedule(timer);
+}
+
+static uint8_t
+timer_read(void *dev, const uint16_t addr)
+{
+	TIMER_CTX *timer = dev;
+	int idx = (addr - timer->baseaddr);
+	uint8_t ch;
+
+	timer_sync(timer);
+	ch = timer->regs[idx];
+
+	/*
+	 * DATA changes without an event at every tick; wake up at the next one
+	 * so a loop polling it is not fast-forwarded past the change.
+	 */
+	m68_event_schedule(timer->ctx, timer->event, timer->ctx->halted_cycles + timer->base + timer->prescaler + 1);
 
 	if (idx == CTRL)
 		ch &= ~PRESCALER_RESET;
 
-	printf("TIMER: reading reg %d: 0x%02x\n", idx, ch);
-	dump();
+//	printf("TIMER: reading reg %d: 0x%02x\n", idx, ch);
 
 	return ch;
 }
 
-void
-timer_write(uint16_t addr, uint8_t data)
+static void
+timer_write(void *dev, const uint16_t addr, uint8_t data)
 {
-	int idx = addr - baseaddr;
+	TIMER_CTX *timer = dev;
+	int idx = addr - timer->baseaddr;
 
-	printf("TIMER: writing reg %d: 0x%02x -> 0x%02x\n", idx, regs[idx], data);
+	timer_sync(timer);
+//	printf("TIMER: writing reg %d: 0x%02x -> 0x%02x\n", idx, timer->regs[idx], data);
 
 	if (idx == CTRL) {
 		if (data & PRESCALER_RESET)
-			prescaler = (1 << PRESCALER_MASK);
+			timer->prescaler = (1 << PRESCALER_MASK);
 		data &= 0xf0;
 		data |= PRESCALER_MASK;
 	}
-	regs[idx] = data;
-
-	dump();
+	timer->regs[idx] = data;
+	timer_update_irq(timer);
+	timer_schedule(timer);
 }
 
-void
-timer_add(int count)
+/*
+ * Attach the timer to a CPU, with its two registers at 'addr'.
+ *
+ * @return	0 on success, -1 if the CPU has no free event slot or the
+ *			registers cannot be registered
+ */
+int
+timer_attach(TIMER_CTX *timer, M68_CTX *ctx, uint16_t addr)
 {
-	while (count-- > 0) {
-		if (prescaler-- > 0)
-			continue;
-		prescaler = (1 << PRESCALER_MASK);
-		if (regs[DATA]-- > 0)
-			continue;
-		regs[DATA] = 0xff;
-		regs[CTRL] |= INTF;
-		if ((regs[CTRL] & INTDISABLE) == 0) {
-			printf("TIMER INTERRUPT");
-		}
-	}
-
-//	dump();
+	timer->ctx = ctx;
+	timer->baseaddr = addr;
+
+	timer->regs[DATA] = 0;
+	timer->regs[CTRL] = INTF | INTDISABLE | PRESCALER_MASK;
+
+	timer->base = m68_clock(ctx);
+	timer->event = m68_event_register(ctx, timer_event, timer);
+	if (timer->event < 0)
+		return -1;
+	timer_schedule(timer);
+	return m68_io_register(ctx, addr, 2, timer_read, timer_write, timer);
 }
@@ -1,8 +1,9 @@
 #include <stdint.h>
 
-int timer_active(uint16_t addr);
-void timer_attach(uint16_t addr);
-uint8_t timer_read(uint16_t addr);
-void timer_write(uint16_t addr, uint8_t data);
+#include "m68emu.h"
 
-void timer_add(int ch);
+typedef struct TIMER_CTX TIMER_CTX;
+
+TIMER_CTX *timer_new(void);
+void timer_destroy(TIMER_CTX *timer);
+int timer_attach(TIMER_CTX *timer, M68_CTX *ctx, uint16_t addr);
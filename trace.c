@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "trace.h"
+
+/* ring of chunks between the emulator and the writer thread */
+#define CHUNK_SIZE	(64 * 1024)
+#define NCHUNKS		8
+
+/* largest encoded record: flags, ext, pc, a, x, sp, ccr, ea, rd, wr, 10-byte skew, 3 code bytes */
+#define MAX_RECORD	(1 + 1 + 2 + 1 + 1 + 2 + 1 + 2 + 1 + 1 + 10 + 3)
+
+
+struct TRACE {
+	FILE *			file;
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;					///< Signalled whenever 'head', 'tail' or 'closing' change
+	uint8_t *		chunks[NCHUNKS];
+	size_t			len[NCHUNKS];			///< Bytes used in each published chunk
+	unsigned		head;					///< Chunks published by the emulator
+	unsigned		tail;					///< Chunks written out by the writer thread
+	bool			closing;
+	bool			error;					///< A write failed
+
+	/* emulator side */
+	uint8_t *		out;					///< Next byte of the chunk being filled
+	uint8_t *		end;					///< End of the chunk being filled, less MAX_RECORD
+	uint64_t		records;
+
+	/* delta state: the previous record */
+	M68_TRACE_REC	prev;
+	bool			have_prev;
+};
+
+
+static void *
+writer(void *arg)
+{
+	TRACE *trace = arg;
+
+	pthread_mutex_lock(&trace->lock);
+	for (;;) {
+		while (trace->tail == trace->head && !trace->closing)
+			pthread_cond_wait(&trace->cond, &trace->lock);
+		if (trace->tail == trace->head)
+			break;
+
+		/* the chunk is ours until 'tail' moves past it */
+		unsigned i = trace->tail % NCHUNKS;
+		pthread_mutex_unlock(&trace->lock);
+		if (fwrite(trace->chunks[i], 1, trace->len[i], trace->file) != trace->len[i])
+			trace->error = true;
+		pthread_mutex_lock(&trace->lock);
+
+		trace->tail++;
+		pthread_cond_broadcast(&trace->cond);
+	}
+	pthread_mutex_unlock(&trace->lock);
+	return NULL;
+}
+
+/*
+ * Publish the chunk being filled and start on the next one, waiting for the
+ * writer if every chunk is still queued.
+ */
+static void
+next_chunk(TRACE *trace)
+{
+	unsigned i = trace->head % NCHUNKS;
+
+	pthread_mutex_lock(&trace->lock);
+	trace->len[i] = trace->out - trace->chunks[i];
+	trace->head++;
+	pthread_cond_broadcast(&trace->cond);
+	while (trace->head - trace->tail == NCHUNKS)
+		pthread_cond_wait(&trace->cond, &trace->lock);
+	pthread_mutex_unlock(&trace->lock);
+
+	i = trace->head % NCHUNKS;
+	trace->out = trace->chunks[i];
+	trace->end = trace->chunks[i] + CHUNK_SIZE - MAX_RECORD;
+}
+
+static inline uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static void
+record(M68_CTX *ctx, const M68_TRACE_REC *rec)
+{
+	TRACE *trace = ctx->trace_user;
+	M68_TRACE_REC *prev = &trace->prev;
+	uint8_t *p = trace->out;
+	uint8_t flags = rec->len - 1;
+	uint8_t ext = 0;
+	uint64_t skew = 0;
+	int i;
+
+	if (trace->have_prev) {
+		if (rec->pc != (uint16_t)(prev->pc + prev->len))
+			flags |= TRACE_PC;
+		if (rec->a != prev->a)
+			flags |= TRACE_A;
+		if (rec->x != prev->x)
+			flags |= TRACE_X;
+		if (rec->sp != prev->sp)
+			flags |= TRACE_SP;
+		if (rec->ccr != prev->ccr)
+			flags |= TRACE_CCR;
+		skew = rec->cycles - (prev->cycles + prev->ncycles);
+	} else {
+		/* the first record carries everything */
+		flags |= TRACE_PC | TRACE_A | TRACE_X | TRACE_SP | TRACE_CCR;
+		skew = rec->cycles;
+	}
+	if (skew)
+		ext |= TRACE_SKEW;
+	if (rec->access & M68_TRACE_RD)
+		ext |= TRACE_RD;
+	if (rec->access & M68_TRACE_WR)
+		ext |= TRACE_WR;
+	if (ext)
+		flags |= TRACE_EXT;
+
+	*p++ = flags;
+	if (ext)
+		*p++ = ext;
+	if (flags & TRACE_PC)
+		p = put16(p, rec->pc);
+	if (flags & TRACE_A)
+		*p++ = rec->a;
+	if (flags & TRACE_X)
+		*p++ = rec->x;
+	if (flags & TRACE_SP)
+		p = put16(p, rec->sp);
+	if (flags & TRACE_CCR)
+		*p++ = rec->ccr;
+	if (ext & TRACE_RD) {
+		p = put16(p, rec->ea);
+		*p++ = rec->rd;
+	}
+	if (ext & TRACE_WR) {
+		if (!(ext & TRACE_RD))
+			p = put16(p, rec->ea);
+		*p++ = rec->wr;
+	}
+	if (ext & TRACE_SKEW) {
+		do {
+			*p++ = (skew & 0x7f) | (skew > 0x7f ? 0x80 : 0);
+			skew >>= 7;
+		} while (skew);
+	}
+	for (i = 0; i < rec->len; i++)
+		*p++ = rec->code[i];
+
+	trace->out = p;
+	trace->prev = *rec;
+	trace->have_prev = true;
+	trace->records++;
+
+	if (trace->out >= trace->end)
+		next_chunk(trace);
+}
+
+/**
+ * Create a trace file and start its writer thread.
+ *
+ * @return	The trace, or NULL on failure
+ */
+TRACE *
+trace_open(const char *filename)
+{
+	TRACE *trace;
+	int i;
+
+	trace = calloc(1, sizeof(TRACE));
+	if (trace == NULL)
+		return NULL;
+	for (i = 0; i < NCHUNKS; i++) {
+		trace->chunks[i] = malloc(CHUNK_SIZE);
+		if (trace->chunks[i] == NULL)
+			goto fail;
+	}
+	trace->file = fopen(filename, "wb");
+	if (trace->file == NULL)
+		goto fail;
+	pthread_mutex_init(&trace->lock, NULL);
+	pthread_cond_init(&trace->cond, NULL);
+
+	/* the header goes in the first chunk, ahead of the records */
+	trace->out = trace->chunks[0];
+	trace->end = trace->chunks[0] + CHUNK_SIZE - MAX_RECORD;
+	memcpy(trace->out, TRACE_MAGIC, 4);
+	trace->out[4] = TRACE_VERSION;
+	trace->out += 5;
+
+	if (pthread_create(&trace->thread, NULL, writer, trace) != 0) {
+		fclose(trace->file);
+		goto fail;
+	}
+	return trace;
+
+fail:
+	for (i = 0; i < NCHUNKS; i++)
+		free(trace->chunks[i]);
+	free(trace);
+	return NULL;
+}
+
+/**
+ * Flush and close a trace file. Detach it from its context first.
+ *
+ * @return	0 on success, -1 if any write failed
+ */
+int
+trace_close(TRACE *trace)
+{
+	int i, rc;
+
+	if (trace == NULL)
+		return 0;
+
+	/* publish the partial chunk; there is always a free one to move on to */
+	next_chunk(trace);
+	pthread_mutex_lock(&trace->lock);
+	trace->closing = true;
+	pthread_cond_broadcast(&trace->cond);
+	pthread_mutex_unlock(&trace->lock);
+	pthread_join(trace->thread, NULL);
+
+	rc = (fclose(trace->file) != 0 || trace->error) ? -1 : 0;
+	pthread_mutex_destroy(&trace->lock);
+	pthread_cond_destroy(&trace->cond);
+	for (i = 0; i < NCHUNKS; i++)
+		free(trace->chunks[i]);
+	free(trace);
+	return rc;
+}
+
+/**
+ * Send the instruction trace of 'ctx' to 'trace'. Tracing still has to be
+ * turned on with ctx->trace.
+ */
+void
+trace_attach(TRACE *trace, M68_CTX *ctx)
+{
+	ctx->trace_func = record;
+	ctx->trace_user = trace;
+}
+
+/**
+ * @return	Number of instructions traced so far
+ */
+uint64_t
+trace_records(TRACE *trace)
+{
+	return trace->records;
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "m68emu.h"
+
+/**
+ * Binary instruction trace.
+ *
+ * Records from the core's trace hook are delta-encoded into fixed-size
+ * chunks; full chunks are handed to a writer thread which streams them to
+ * disk, so the emulator only blocks if the disk falls a whole ring behind.
+ * Decode the file with m68trace.
+ *
+ * File format: the magic "M68T" and a version byte, then one record per
+ * instruction. Each record starts with a flags byte:
+ *
+ *	bits 0-1	instruction length - 1
+ *	bit 2		PC follows (2 bytes), else PC is the previous PC plus its length
+ *	bit 3		A follows
+ *	bit 4		X follows
+ *	bit 5		SP follows (2 bytes)
+ *	bit 6		CCR follows
+ *	bit 7		an extension byte follows
+ *
+ * and the extension byte, when present:
+ *
+ *	bit 0		memory read: address (2 bytes) and value
+ *	bit 1		memory write: value, plus the address if there was no read
+ *	bit 2		extra cycles (LEB128) elapsed before this instruction, beyond
+ *				the previous instruction's own (interrupts, WAIT, STOP)
+ *
+ * Registers are only written when they differ from the previous record.
+ * The fields follow in the order above, 16-bit values big-endian, and the
+ * instruction bytes come last.
+ */
+
+#define TRACE_MAGIC		"M68T"
+#define TRACE_VERSION	1
+
+/* record flags */
+#define TRACE_LEN		0x03
+#define TRACE_PC		0x04
+#define TRACE_A			0x08
+#define TRACE_X			0x10
+#define TRACE_SP		0x20
+#define TRACE_CCR		0x40
+#define TRACE_EXT		0x80
+
+/* extension flags */
+#define TRACE_RD		0x01
+#define TRACE_WR		0x02
+#define TRACE_SKEW		0x04
+
+typedef struct TRACE TRACE;
+
+TRACE *trace_open(const char *filename);
+int trace_close(TRACE *trace);
+void trace_attach(TRACE *trace, M68_CTX *ctx);
+uint64_t trace_records(TRACE *trace);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "uart.h"
@@ -33,39 +34,94 @@
 #define		FE	0x02
 #define SCDAT	4		/* sci data register (read: RDR, write: TDR) */
 
-static unsigned int baseaddr;
-static uint8_t regs[4];
-static uint8_t txreg;
-static uint8_t rxreg;
+/* bus cycles per bit at the fastest rate; SCP and SCR divide it down */
+#define BIT_CYCLES	16
 
-static void (*on_write)(uint8_t data);
+struct UART_CTX {
+	M68_CTX *ctx;
+	unsigned int baseaddr;
+	uint8_t regs[4];
+	uint8_t txreg;
+	uint8_t rxreg;
+	bool irq;		/* state of the SCI interrupt request */
+	int event;		/* transmitter finishes the character in TDR */
+
+	void (*on_write)(void *user, uint8_t data);
+	void *user;
+};
+
+/*
+ * Drive the SCI interrupt request from the enabled status flags. The CPU
+ * is only told when the request changes, since raising it ends the
+ * current run slice.
+ */
+static void
+uart_update_irq(UART_CTX *uart)
+{
+	uint8_t ctrl = uart->regs[SCCR2], stat = uart->regs[SCSR];
+	bool irq = ((ctrl & TIE) && (stat & TDRE)) || ((ctrl & TCIE) && (stat & TC)) ||
+		((ctrl & RIE) && (stat & RDRF));
+
+	if (irq == uart->irq)
+		return;
+	uart->irq = irq;
+	if (irq)
+		m68_irq(uart->ctx, M68_VEC_SCI);
+	else
+		m68_irq_clear(uart->ctx, M68_VEC_SCI);
+}
+
+UART_CTX *
+uart_new(void)
+{
+	return calloc(1, sizeof(UART_CTX));
+}
 
 void
-uart_attach(uint16_t addr, void (*on_tx)(uint8_t))
+uart_destroy(UART_CTX *uart)
+{
+	free(uart);
+}
+
+/*
+ * Bus cycles to shift out one character at the rate set in BRATE: a start
+ * bit, 8 or 9 data bits and a stop bit.
+ */
+static uint64_t
+uart_char_cycles(UART_CTX *uart)
 {
-	baseaddr = addr;
-	on_write = on_tx;
+	static const unsigned int prescale[4] = { 1, 3, 4, 13 };
+	uint8_t brate = uart->regs[BRATE];
+	unsigned int bits = (uart->regs[SCCR1] & M) ? 11 : 10;
 
-	regs[SCSR] |= TDRE;
+	return (uint64_t)bits * BIT_CYCLES * prescale[(brate & (SCP1 | SCP0)) >> 4] << (brate & (SCR2 | SCR1 | SCR0));
 }
 
-int 
-uart_active(uint16_t addr)
+/*
+ * The character has been shifted out: TDR is free again.
+ */
+static void
+uart_event(M68_CTX *ctx, void *user)
 {
-	return (addr >= baseaddr && addr<baseaddr+5);
+	UART_CTX *uart = user;
+
+	uart->regs[SCSR] |= TDRE | TC;
+	uart_update_irq(uart);
 }
 
-uint8_t
-uart_read(uint16_t addr)
+static uint8_t
+uart_read(void *dev, const uint16_t addr)
 {
-	int idx = addr - baseaddr;
-	uint8_t ch = regs[idx];
+	UART_CTX *uart = dev;
+	int idx = addr - uart->baseaddr;
+	uint8_t ch;
 
 	if (idx == SCDAT) {
-		ch = rxreg;
-		regs[SCSR] &= ~RDRF;
+		ch = uart->rxreg;
+		uart->regs[SCSR] &= ~RDRF;
+		uart_update_irq(uart);
 	} else {
-		ch = regs[idx];
+		ch = uart->regs[idx];
 	}
 
 //	printf("UART: reading reg %d: 0x%02x\n", idx, ch);
@@ -73,25 +129,57 @@ uart_read(uint16_t addr)
 	return ch;
 }
 
-void
-uart_write(uint16_t addr, uint8_t data)
+static void
+uart_write(void *dev, const uint16_t addr, const uint8_t data)
 {
-	int idx = addr - baseaddr;
+	UART_CTX *uart = dev;
+	int idx = addr - uart->baseaddr;
 
 //	printf("UART: writing reg %d: 0x%02x\n", idx, data);
 
 	if (idx == SCDAT) {
-		txreg = data;
-		if (on_write) on_write(data);
-		regs[SCSR] |= TDRE;
+		uart->txreg = data;
+		if (uart->on_write) uart->on_write(uart->user, data);
+		/* the character is passed on at once, but TDR stays full while it is sent */
+		uart->regs[SCSR] &= ~(TDRE | TC);
+		m68_event_schedule(uart->ctx, uart->event, uart->ctx->cycles + uart_char_cycles(uart));
 	} else {
-		regs[idx] = data;
+		uart->regs[idx] = data;
 	}
+	uart_update_irq(uart);
+}
+
+/*
+ * Attach the SCI to 'ctx' with its five registers at 'addr'.
+ *
+ * @return	0, or -1 if the CPU has no free event slot or the registers
+ *			cannot be registered
+ */
+int
+uart_attach(UART_CTX *uart, M68_CTX *ctx, uint16_t addr, void (*on_tx)(void *, uint8_t), void *user)
+{
+	uart->ctx = ctx;
+	uart->baseaddr = addr;
+	uart->on_write = on_tx;
+	uart->user = user;
+
+	uart->regs[SCSR] |= TDRE | TC;
+	uart->event = m68_event_register(ctx, uart_event, uart);
+	if (uart->event < 0)
+		return -1;
+	return m68_io_register(ctx, addr, 5, uart_read, uart_write, uart);
+}
+
+int
+uart_rx_full(UART_CTX *uart)
+{
+	return (uart->regs[SCSR] & RDRF) != 0;
 }
 
 void
-uart_rx(uint8_t data)
+uart_rx(UART_CTX *uart, uint8_t data)
 {
-	rxreg = data;
-	regs[SCSR] |= RDRF;
+	uart->rxreg = data;
+	uart->regs[SCSR] |= RDRF;
+	uart_update_irq(uart);
 }
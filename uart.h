@@ -1,8 +1,12 @@
 #include <stdint.h>
 
-int uart_active(uint16_t addr);
-void uart_attach(uint16_t addr, void (*on_tx)(uint8_t));
-uint8_t uart_read(uint16_t addr);
-void uart_write(uint16_t addr, uint8_t data);
+#include "m68emu.h"
 
-void uart_rx(uint8_t ch);
+typedef struct UART_CTX UART_CTX;
+
+UART_CTX *uart_new(void);
+void uart_destroy(UART_CTX *uart);
+int uart_attach(UART_CTX *uart, M68_CTX *ctx, uint16_t addr, void (*on_tx)(void *user, uint8_t), void *user);
+
+int uart_rx_full(UART_CTX *uart);
+void uart_rx(UART_CTX *uart, uint8_t ch);